@@ -8,48 +8,350 @@
 #include <string.h>    // memset, memcpy
 #include <stdint.h>    // integer types
 #include <emmintrin.h> // x86 SSE intrinsics
+#include <immintrin.h> // x86 AVX2/AVX-512 intrinsics
 #include <stdio.h>
+#include <math.h>
 #include <assert.h>
-#include <sys/time.h>  // gettime
-#include <algorithm>   // std::random_shuffle
+#include <algorithm>   // std::sort, std::shuffle
 #include "ART.hpp"
-#include <unicode/ucol.h>
+#ifdef ART_ICU
+#include <unicode/ustring.h>
+#endif
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <fcntl.h>     // open
+#include <sys/mman.h>  // mmap
+#include <sys/stat.h>  // fstat
+#include <unistd.h>    // close, pread
+#ifdef __linux__
+#include <sys/syscall.h>      // SYS_mbind, SYS_getcpu
+#include <linux/mempolicy.h>  // MPOL_BIND, MPOL_INTERLEAVE
+#endif
+
+// Nodes are allocated from the current arena of the thread
+static Arena defaultArena;
+static thread_local Arena* currentArena=&defaultArena;
+
+// Linear nodes add their buckets to the size given here
+static const size_t nodeSizes[NodeTypeCount]={sizeof(Node4),sizeof(Node16),sizeof(Node48),sizeof(Node256),sizeof(NodeLinear),sizeof(NodeLazy),sizeof(Node32)};
+
+static inline size_t nodeSize(Node* node) {
+   // Bytes of an inner node
+   if (node->type==NodeTypeLinear)
+      return linearNodeSize(static_cast<NodeLinear*>(node)->fanout);
+   return nodeSizes[node->type];
+}
+
+static inline unsigned nodePool(Node* node) {
+   // Arena pool of an inner node
+   if (node->type==NodeTypeLinear)
+      return NodeTypeCount+linearFanoutClass(static_cast<NodeLinear*>(node)->fanout);
+   return node->type;
+}
+
+static unsigned readNumaNodes() {
+   // Highest online node plus one, from a sysfs list like "0-1" or "0,2"
+   unsigned nodes=1;
+   FILE* in=fopen("/sys/devices/system/node/online","r");
+   if (in) {
+      unsigned node;
+      while (fscanf(in,"%u",&node)==1) {
+         nodes=std::max(nodes,node+1);
+         fgetc(in);
+      }
+      fclose(in);
+   }
+   return nodes;
+}
+
+unsigned numaNodeCount() {
+   // NUMA nodes of the machine, 1 where that is unknown
+   static const unsigned nodes=readNumaNodes();
+   return nodes;
+}
+
+unsigned numaNodeOfThread() {
+   // NUMA node the calling thread runs on, looked up once per thread; pin
+   // threads that read replicas to their node
+   static thread_local int node=-1;
+   if (node<0) {
+      unsigned cpu=0,current=0;
+#ifdef __linux__
+      if (syscall(SYS_getcpu,&cpu,&current,NULL)!=0)
+         current=0;
+#endif
+      node=std::min(current,numaNodeCount()-1);
+   }
+   return node;
+}
+
+#ifndef ART_MALLOC_NODES
+static void placePage(void* page,int numaNode) {
+   // Apply the NUMA policy of an arena to a new page, moving the parts
+   // malloc had already touched. Best effort: without NUMA support the page
+   // stays where first touch put it
+#ifdef __linux__
+   if (numaNode==ARENA_NUMA_ANY)
+      return;
+   unsigned long mask[4]={};
+   const unsigned maskBits=8*sizeof(mask);
+   unsigned nodes=std::min(numaNodeCount(),maskBits);
+   int mode=MPOL_BIND;
+   if (numaNode==ARENA_NUMA_INTERLEAVE) {
+      mode=MPOL_INTERLEAVE;
+      for (unsigned i=0;i<nodes;i++)
+         mask[i/64]|=1ul<<(i%64);
+   } else if (static_cast<unsigned>(numaNode)<nodes) {
+      mask[numaNode/64]|=1ul<<(numaNode%64);
+   } else {
+      return;
+   }
+   syscall(SYS_mbind,page,ARENA_PAGE_SIZE,mode,mask,maskBits+1,MPOL_MF_MOVE);
+#else
+   (void)page;
+   (void)numaNode;
+#endif
+}
+#endif
+
+Arena::Arena(int numaNode) : numaNode(numaNode) {
+   // Slots are 8-byte aligned (64 bytes where the node type asks for it,
+   // linear node sizes are multiples of 64)
+   for (int8_t type=0;type<NodeTypeCount;type++)
+      if (type!=NodeTypeLinear)
+         pools[type].slotSize=(nodeSizes[type]+7)&~static_cast<size_t>(7);
+   for (unsigned c=0;c<LINEAR_FANOUT_CLASSES;c++)
+      pools[NodeTypeCount+c].slotSize=linearNodeSize(LINEAR_MIN_FANOUT<<c);
+}
+
+Arena::~Arena() {
+   releaseArena(this);
+}
+
+Arena* getArena() {
+   return currentArena;
+}
+
+Arena* setArena(Arena* arena) {
+   // Make arena the one this thread allocates nodes from (freed nodes go
+   // back to their own arena); modify a tree with the arena it was built
+   // with to keep its nodes together
+   Arena* previous=currentArena;
+   currentArena=arena?arena:&defaultArena;
+   return previous;
+}
+
+#ifdef ART_MALLOC_NODES
+// Every slot is a heap allocation of its own behind a 64-byte header that
+// links it into its pool (pages heads the list, pageCount counts the
+// slots), so an arena can still drop all of its nodes at once. NUMA
+// placement is not supported.
+struct SlotHeader {
+   SlotHeader* prev;
+   SlotHeader* next;
+   // pool the slot was allocated from
+   NodePool* pool;
+};
+
+static inline NodePool* slotPool(void* slot) {
+   // Pool a slot of poolAlloc belongs to
+   return reinterpret_cast<SlotHeader*>(static_cast<uint8_t*>(slot)-64)->pool;
+}
+
+static inline size_t pageBytes(const NodePool& pool) {
+   // Bytes per unit of pageCount, a slot with its header
+   return 64+((pool.slotSize+63)&~static_cast<size_t>(63));
+}
+
+static void releasePool(NodePool& pool) {
+   // Free the slots of a pool
+   SlotHeader* header=static_cast<SlotHeader*>(pool.pages);
+   while (header) {
+      SlotHeader* next=header->next;
+      free(header);
+      header=next;
+   }
+   pool.pages=NULL;
+   pool.pageCount=0;
+}
+
+static void* poolAlloc(NodePool& pool,int) {
+   // New slot, linked first into the pool
+   SlotHeader* header=static_cast<SlotHeader*>(aligned_alloc(64,pageBytes(pool)));
+   header->pool=&pool;
+   while (pool.lock.test_and_set(std::memory_order_acquire));
+   header->prev=NULL;
+   header->next=static_cast<SlotHeader*>(pool.pages);
+   if (header->next)
+      header->next->prev=header;
+   pool.pages=header;
+   pool.pageCount++;
+   pool.lock.clear(std::memory_order_release);
+   return reinterpret_cast<uint8_t*>(header)+64;
+}
+
+static void poolFree(NodePool& pool,void* slot) {
+   // Unlink the slot and free it
+   SlotHeader* header=reinterpret_cast<SlotHeader*>(static_cast<uint8_t*>(slot)-64);
+   while (pool.lock.test_and_set(std::memory_order_acquire));
+   if (header->prev)
+      header->prev->next=header->next;
+   else
+      pool.pages=header->next;
+   if (header->next)
+      header->next->prev=header->prev;
+   pool.pageCount--;
+   pool.lock.clear(std::memory_order_release);
+   free(header);
+}
+#else
+// Pages are aligned to their size, so a slot finds the pool it belongs to
+// in the first cache line of its page, which also links the page list
+struct PageHeader {
+   void* next;
+   NodePool* pool;
+};
+
+static inline size_t pageBytes(const NodePool&) {
+   // Bytes per unit of pageCount
+   return ARENA_PAGE_SIZE;
+}
+
+static inline NodePool* slotPool(void* slot) {
+   // Pool a slot of poolAlloc belongs to
+   uintptr_t page=reinterpret_cast<uintptr_t>(slot)&~static_cast<uintptr_t>(ARENA_PAGE_SIZE-1);
+   return reinterpret_cast<PageHeader*>(page)->pool;
+}
+
+static void releasePool(NodePool& pool) {
+   // Free the pages of a pool
+   while (pool.pages) {
+      void* page=pool.pages;
+      pool.pages=static_cast<PageHeader*>(page)->next;
+      free(page);
+   }
+   pool.freeList=NULL;
+   pool.bump=pool.end=NULL;
+   pool.pageCount=0;
+}
+
+static void* poolAlloc(NodePool& pool,int numaNode) {
+   // Take a slot from the free list, or from the current page
+   while (pool.lock.test_and_set(std::memory_order_acquire));
+   void* slot=pool.freeList;
+   if (slot) {
+      pool.freeList=*reinterpret_cast<void**>(slot);
+   } else {
+      if (pool.bump+pool.slotSize>pool.end) {
+         // The first cache line of a page links it into the page list
+         uint8_t* page=static_cast<uint8_t*>(aligned_alloc(ARENA_PAGE_SIZE,ARENA_PAGE_SIZE));
+         placePage(page,numaNode);
+         PageHeader* header=reinterpret_cast<PageHeader*>(page);
+         header->next=pool.pages;
+         header->pool=&pool;
+         pool.pages=page;
+         pool.pageCount++;
+         pool.bump=page+64;
+         pool.end=page+ARENA_PAGE_SIZE;
+      }
+      slot=pool.bump;
+      pool.bump+=pool.slotSize;
+   }
+   pool.lock.clear(std::memory_order_release);
+   return slot;
+}
+
+static void poolFree(NodePool& pool,void* slot) {
+   // Return a slot to the free list
+   while (pool.lock.test_and_set(std::memory_order_acquire));
+   *reinterpret_cast<void**>(slot)=pool.freeList;
+   pool.freeList=slot;
+   pool.lock.clear(std::memory_order_release);
+}
+#endif
+
+void releaseArena(Arena* arena) {
+   // Free all nodes of the arena at once, page by page
+   for (unsigned p=0;p<ARENA_POOLS;p++)
+      releasePool(arena->pools[p]);
+}
+
+void* arenaAlloc(unsigned p) {
+   // Slot of pool p of the current arena
+   return poolAlloc(currentArena->pools[p],currentArena->numaNode);
+}
+
+void freeNode(Node* node) {
+   // Return the slot of node to the pool it was allocated from, whichever
+   // arena the calling thread uses
+   poolFree(*slotPool(node),node);
+}
+
+LeafArena::LeafArena(unsigned maxKeyLength) : maxKeyLength(maxKeyLength) {
+   // Records of the longest key, 8-byte aligned
+   pool.slotSize=(sizeof(LeafRecord)+maxKeyLength+7)&~static_cast<size_t>(7);
+}
+
+LeafArena::~LeafArena() {
+   releasePool(pool);
+}
+
+LeafRecord* allocRecord(LeafArena& arena,const uint8_t key[],unsigned keyLength,uint64_t payload) {
+   // New record holding the key (at most arena.maxKeyLength bytes) and payload
+   assert(keyLength<=arena.maxKeyLength);
+   LeafRecord* record=static_cast<LeafRecord*>(poolAlloc(arena.pool,ARENA_NUMA_ANY));
+   record->payload=payload;
+   record->keyLength=keyLength;
+   memcpy(recordKey(record),key,keyLength);
+   return record;
+}
+
+void freeRecord(LeafArena& arena,LeafRecord* record) {
+   assert(slotPool(record)==&arena.pool);
+   poolFree(arena.pool,record);
+}
+
+void loadKeyRecord(uintptr_t tid,uint8_t key[]) {
+   // Key loader for leaves made with makeRecordLeaf
+   const LeafRecord* record=reinterpret_cast<const LeafRecord*>(tid);
+   memcpy(key,recordKey(record),record->keyLength);
+}
 
-inline Node* makeLeaf(uintptr_t tid) {
-   // Create a pseudo-leaf
-   return reinterpret_cast<Node*>((tid<<1)|1);
+void loadKeyUInt64(uintptr_t tid,uint8_t key[]) {
+   // Default key loader: the tuple identifier is the key, stored big endian;
+   // key buffers need not be aligned
+   uint64_t swapped=__builtin_bswap64(tid);
+   memcpy(key,&swapped,8);
 }
 
+// Key loader of the thread, set like the arena
+static thread_local KeyLoader currentKeyLoader=loadKeyUInt64;
 
+KeyLoader getKeyLoader() {
+   return currentKeyLoader;
+}
 
-uint8_t flipSign(uint8_t keyByte) {
-   // Flip the sign bit, enables signed SSE comparison of unsigned values, used by Node16
-   return keyByte^128;
+KeyLoader setKeyLoader(KeyLoader loader) {
+   // Make loader the one this thread's tree operations load leaf keys with,
+   // a tree must always be accessed with the loader it was built with
+   KeyLoader previous=currentKeyLoader;
+   currentKeyLoader=loader?loader:loadKeyUInt64;
+   return previous;
 }
 
 void loadKey(uintptr_t tid,uint8_t key[]) {
    // Store the key of the tuple into the key vector
-   // Implementation is database specific
-   reinterpret_cast<uint64_t*>(key)[0]=__builtin_bswap64(tid);
+   // Implementation is database specific, see setKeyLoader
+   currentKeyLoader(tid,key);
 }
 
 // This address is used to communicate that search failed
 Node* nullNode=NULL;
 
-static inline unsigned ctz(uint16_t x) {
-   // Count trailing zeros, only defined for x>0
-#ifdef __GNUC__
-   return __builtin_ctz(x);
-#else
-   // Adapted from Hacker's Delight
-   unsigned n=1;
-   if ((x&0xFF)==0) {n+=8; x=x>>8;}
-   if ((x&0x0F)==0) {n+=4; x=x>>4;}
-   if ((x&0x03)==0) {n+=2; x=x>>2;}
-   return n-(x&1);
-#endif
-}
 
 void printkey(uint8_t *key) {
    for(int i=0; i<8; i++) {
@@ -59,51 +361,184 @@ void printkey(uint8_t *key) {
    return;
 }
 
-Node** findChild(Node* n,uint8_t keyByte) {
-   // Find the next child for the keyByte
-   switch (n->type) {
-      case NodeType4: {
-         // printf("node4\n");
-         Node4* node=static_cast<Node4*>(n);
-         for (unsigned i=0;i<node->count;i++) {
-            //printf("i: %d\n", node->key[i]);
-            if (node->key[i]==keyByte)
-               return &node->child[i];
-         }
-         return &nullNode;
-      }
-      case NodeType16: {
-         Node16* node=static_cast<Node16*>(n);
-         __m128i cmp=_mm_cmpeq_epi8(_mm_set1_epi8(flipSign(keyByte)),_mm_loadu_si128(reinterpret_cast<__m128i*>(node->key)));
-         unsigned bitfield=_mm_movemask_epi8(cmp)&((1<<node->count)-1);
-         if (bitfield)
-            return &node->child[ctz(bitfield)]; else
-            return &nullNode;
-      }
-      case NodeType48: {
-         Node48* node=static_cast<Node48*>(n);
-         if (node->childIndex[keyByte]!=emptyMarker)
-            return &node->child[node->childIndex[keyByte]]; else
-            return &nullNode;
-      }
-      case NodeType256: {
-         Node256* node=static_cast<Node256*>(n);
-         return &(node->child[keyByte]);
-      }
-      case NodeTypeLinear: {
-         // printf("nodelinear\n");
-         NodeLinear* node=static_cast<NodeLinear*>(n);
-         int bucket = (int)(node->a*keyByte+node->b);
-         if(bucket >= LINEAR_SIZE) {
-            return &(node->child[LINEAR_SIZE-1]);
-         } else if(bucket < 0) {
-            return &(node->child[0]);
-         } else {
-            return &(node->child[bucket]);
-         }
-      }
+// Slot scans. Node256 and linear nodes are searched for non-null child
+// pointers, Node48 for used childIndex entries; minimum, maximum and the
+// iterators run them on every node they pass. The kernels use the widest
+// vector unit of the machine.
+
+static int simdLevel() {
+   // Vector unit of the kernels, 2: AVX-512, 1: AVX2, 0: SSE2; the widest
+   // of the machine, at most ART_SIMD_MAX
+#ifdef __GNUC__
+   static const int level=std::min(ART_SIMD_MAX,__builtin_cpu_supports("avx512f")?2:__builtin_cpu_supports("avx2")?1:0);
+   return level;
+#else
+   return 0;
+#endif
+}
+
+static int firstChildScalar(Node* const* child,int from,int end) {
+   for (;from<end;from++)
+      if (child[from])
+         return from;
+   return -1;
+}
+
+static int lastChildScalar(Node* const* child,int end) {
+   for (end--;end>=0;end--)
+      if (child[end])
+         return end;
+   return -1;
+}
+
+#ifdef __GNUC__
+__attribute__((target("avx2")))
+static int firstChildAVX2(Node* const* child,int from,int end) {
+   // 4 slots per step
+   for (;from+4<=end;from+=4) {
+      __m256i slots=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(child+from));
+      unsigned empty=_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(slots,_mm256_setzero_si256())));
+      if (empty!=0xF)
+         return from+__builtin_ctz(~empty);
    }
-   throw; // Unreachable
+   return firstChildScalar(child,from,end);
+}
+
+__attribute__((target("avx2")))
+static int lastChildAVX2(Node* const* child,int end) {
+   for (;end>=4;end-=4) {
+      __m256i slots=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(child+end-4));
+      unsigned used=~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(slots,_mm256_setzero_si256())))&0xF;
+      if (used)
+         return end-4+31-__builtin_clz(used);
+   }
+   return lastChildScalar(child,end);
+}
+
+__attribute__((target("avx512f")))
+static int firstChildAVX512(Node* const* child,int from,int end) {
+   // 8 slots per step
+   for (;from+8<=end;from+=8) {
+      __m512i slots=_mm512_loadu_si512(child+from);
+      unsigned used=_mm512_test_epi64_mask(slots,slots);
+      if (used)
+         return from+__builtin_ctz(used);
+   }
+   return firstChildScalar(child,from,end);
+}
+
+__attribute__((target("avx512f")))
+static int lastChildAVX512(Node* const* child,int end) {
+   for (;end>=8;end-=8) {
+      __m512i slots=_mm512_loadu_si512(child+end-8);
+      unsigned used=_mm512_test_epi64_mask(slots,slots);
+      if (used)
+         return end-8+31-__builtin_clz(used);
+   }
+   return lastChildScalar(child,end);
+}
+
+__attribute__((target("avx2")))
+static int firstIndexAVX2(const uint8_t* childIndex,int from) {
+   // 32 entries per step
+   __m256i marker=_mm256_set1_epi8(emptyMarker);
+   for (;from+32<=256;from+=32) {
+      __m256i entries=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(childIndex+from));
+      uint32_t used=~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(entries,marker)));
+      if (used)
+         return from+__builtin_ctz(used);
+   }
+   for (;from<256;from++)
+      if (childIndex[from]!=emptyMarker)
+         return from;
+   return -1;
+}
+
+__attribute__((target("avx2")))
+static int lastIndexAVX2(const uint8_t* childIndex,int end) {
+   __m256i marker=_mm256_set1_epi8(emptyMarker);
+   for (;end>=32;end-=32) {
+      __m256i entries=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(childIndex+end-32));
+      uint32_t used=~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(entries,marker)));
+      if (used)
+         return end-32+31-__builtin_clz(used);
+   }
+   for (end--;end>=0;end--)
+      if (childIndex[end]!=emptyMarker)
+         return end;
+   return -1;
+}
+#endif
+
+static int firstIndexSSE2(const uint8_t* childIndex,int from) {
+   // 16 entries per step, every x86-64 machine has SSE2
+   __m128i marker=_mm_set1_epi8(emptyMarker);
+   for (;from+16<=256;from+=16) {
+      __m128i entries=_mm_loadu_si128(reinterpret_cast<const __m128i*>(childIndex+from));
+      unsigned used=~_mm_movemask_epi8(_mm_cmpeq_epi8(entries,marker))&0xFFFF;
+      if (used)
+         return from+__builtin_ctz(used);
+   }
+   for (;from<256;from++)
+      if (childIndex[from]!=emptyMarker)
+         return from;
+   return -1;
+}
+
+static int lastIndexSSE2(const uint8_t* childIndex,int end) {
+   __m128i marker=_mm_set1_epi8(emptyMarker);
+   for (;end>=16;end-=16) {
+      __m128i entries=_mm_loadu_si128(reinterpret_cast<const __m128i*>(childIndex+end-16));
+      unsigned used=~_mm_movemask_epi8(_mm_cmpeq_epi8(entries,marker))&0xFFFF;
+      if (used)
+         return end-16+31-__builtin_clz(used);
+   }
+   for (end--;end>=0;end--)
+      if (childIndex[end]!=emptyMarker)
+         return end;
+   return -1;
+}
+
+static int firstChild(Node* const* child,int from,int end) {
+   // First non-null slot in child[from..end), -1 if there is none
+#ifdef __GNUC__
+   int level=simdLevel();
+   if (level==2)
+      return firstChildAVX512(child,from,end);
+   if (level==1)
+      return firstChildAVX2(child,from,end);
+#endif
+   return firstChildScalar(child,from,end);
+}
+
+static int lastChild(Node* const* child,int end) {
+   // Last non-null slot in child[0..end), -1 if there is none
+#ifdef __GNUC__
+   int level=simdLevel();
+   if (level==2)
+      return lastChildAVX512(child,end);
+   if (level==1)
+      return lastChildAVX2(child,end);
+#endif
+   return lastChildScalar(child,end);
+}
+
+static int firstIndex(const uint8_t* childIndex,int from) {
+   // First used entry of a Node48 childIndex at or after from, -1 if none
+#ifdef __GNUC__
+   if (simdLevel())
+      return firstIndexAVX2(childIndex,from);
+#endif
+   return firstIndexSSE2(childIndex,from);
+}
+
+static int lastIndex(const uint8_t* childIndex,int end) {
+   // Last used entry of a Node48 childIndex before end, -1 if none
+#ifdef __GNUC__
+   if (simdLevel())
+      return lastIndexAVX2(childIndex,end);
+#endif
+   return lastIndexSSE2(childIndex,end);
 }
 
 Node* minimum(Node* node) {
@@ -123,19 +558,26 @@ Node* minimum(Node* node) {
          Node16* n=static_cast<Node16*>(node);
          return minimum(n->child[0]);
       }
+      case NodeType32: {
+         Node32* n=static_cast<Node32*>(node);
+         return minimum(n->child[0]);
+      }
       case NodeType48: {
          Node48* n=static_cast<Node48*>(node);
-         unsigned pos=0;
-         while (n->childIndex[pos]==emptyMarker)
-            pos++;
-         return minimum(n->child[n->childIndex[pos]]);
+         return minimum(n->child[n->childIndex[firstIndex(n->childIndex,0)]]);
       }
       case NodeType256: {
          Node256* n=static_cast<Node256*>(node);
-         unsigned pos=0;
-         while (!n->child[pos])
-            pos++;
-         return minimum(n->child[pos]);
+         return minimum(n->child[firstChild(n->child,0,256)]);
+      }
+      case NodeTypeLinear: {
+         NodeLinear* n=static_cast<NodeLinear*>(node);
+         return minimum(linearChildren(n)[firstChild(linearChildren(n),0,n->fanout)]);
+      }
+      case NodeTypeLazy: {
+         // The pending key range is sorted
+         NodeLazy* n=static_cast<NodeLazy*>(node);
+         return makeLeaf(n->keys[0]);
       }
    }
    throw; // Unreachable
@@ -158,19 +600,25 @@ Node* maximum(Node* node) {
          Node16* n=static_cast<Node16*>(node);
          return maximum(n->child[n->count-1]);
       }
+      case NodeType32: {
+         Node32* n=static_cast<Node32*>(node);
+         return maximum(n->child[n->count-1]);
+      }
       case NodeType48: {
          Node48* n=static_cast<Node48*>(node);
-         unsigned pos=255;
-         while (n->childIndex[pos]==emptyMarker)
-            pos--;
-         return maximum(n->child[n->childIndex[pos]]);
+         return maximum(n->child[n->childIndex[lastIndex(n->childIndex,256)]]);
       }
       case NodeType256: {
          Node256* n=static_cast<Node256*>(node);
-         unsigned pos=255;
-         while (!n->child[pos])
-            pos--;
-         return maximum(n->child[pos]);
+         return maximum(n->child[lastChild(n->child,256)]);
+      }
+      case NodeTypeLinear: {
+         NodeLinear* n=static_cast<NodeLinear*>(node);
+         return maximum(linearChildren(n)[lastChild(linearChildren(n),n->fanout)]);
+      }
+      case NodeTypeLazy: {
+         NodeLazy* n=static_cast<NodeLazy*>(node);
+         return makeLeaf(n->keys[n->size-1]);
       }
    }
    throw; // Unreachable
@@ -190,121 +638,291 @@ bool leafMatches(Node* leaf,uint8_t key[],unsigned keyLength,unsigned depth,unsi
 
 unsigned prefixMismatch(Node* node,uint8_t key[],unsigned depth,unsigned maxKeyLength) {
    // Compare the key with the prefix of the node, return the number matching bytes
-   unsigned pos;
-   if (node->prefixLength>maxPrefixLength) {
-      for (pos=0;pos<maxPrefixLength;pos++)
-         if (key[depth+pos]!=node->prefix[pos])
-            return pos;
-      uint8_t minKey[maxKeyLength];
-      loadKey(getLeafValue(minimum(node)),minKey);
-      for (;pos<node->prefixLength;pos++)
-         if (key[depth+pos]!=minKey[depth+pos])
-            return pos;
-   } else {
-      for (pos=0;pos<node->prefixLength;pos++)
-         if (key[depth+pos]!=node->prefix[pos])
-            return pos;
-   }
+   unsigned pos=matchPrefix(node,key,depth,maxKeyLength);
+   if (pos<maxPrefixLength||node->prefixLength<=maxPrefixLength)
+      return pos;
+   // The rest of the prefix is not stored, take it from the minimum leaf
+   uint8_t minKey[maxKeyLength];
+   loadKey(getLeafValue(minimum(node)),minKey);
+   for (;pos<node->prefixLength;pos++)
+      if (key[depth+pos]!=minKey[depth+pos])
+         return pos;
    return pos;
 }
 
 
-void travelNode4(Node4* node, int depth, int nodes[5], int mode);
-void travelNode16(Node16* node, int depth, int nodes[5], int mode);
-void travelNode48(Node48* node, int depth, int nodes[5], int mode);
-void travelNode256(Node256* node, int depth, int nodes[5], int mode);
-void travelNodeLinear(NodeLinear* node, int depth, int nodes[5], int mode);
-
-void travel(Node* node, int depth, int nodes[5], int mode) {
-
-   if (node==NULL) {
-      return;
-   } else if (isLeaf(node)) {
-      // printf("leaf value: %d\n", getLeafValue(node));
-      return;
-   }
+const char* const nodeTypeNames[NodeTypeCount]={"node4","node16","node48","node256","linear","lazy","node32"};
 
-   // printf("traveling node type %d with depth %d\n", node->type, depth);
-   if(mode == COUNT_NODES) nodes[node->type]++;
+struct StatsFrame {
+   Node* node;
+   unsigned level;
+};
 
-   switch (node->type) {
-      case NodeType4:
-         travelNode4(static_cast<Node4*>(node), depth, nodes, mode);
-         break;
-      case NodeType16:
-         travelNode16(static_cast<Node16*>(node), depth, nodes, mode);
-         break;
-      case NodeType48:
-         travelNode48(static_cast<Node48*>(node), depth, nodes, mode);
-         break;
-      case NodeType256:
-         travelNode256(static_cast<Node256*>(node), depth, nodes, mode);
-         break;
-      case NodeTypeLinear:
-         travelNodeLinear(static_cast<NodeLinear*>(node), depth, nodes, mode);
-         break;
+static inline void visitChild(TreeStats& stats,std::vector<StatsFrame>& stack,Node* child,unsigned level) {
+   // Queue an inner child, count a leaf child in place
+   if (isLeaf(child)) {
+      stats.leaves++;
+      stats.leafLevel[std::min(level,STATS_MAX_LEVEL-1)]++;
+      stats.height=std::max(stats.height,level+1);
+   } else {
+      stack.push_back({child,level});
    }
-   return;
 }
 
-void travelNode4(Node4* node, int depth, int nodes[5], int mode) {
-   // printf("node4 has count %d\n", node->count);
-   for(int i=0; i < node->count; i++) {
-      if(mode == CHILDREN_NODES && (isLeaf(node->child[i]) || node->child[i] != NULL)) nodes[node->type]++;
-      travel(node->child[i], depth+node->prefixLength, nodes, mode);
+void collectStats(Node* root,TreeStats& stats) {
+   // One pass over the tree with an explicit stack; slot scans of the sparse
+   // node types stop once all count children were seen
+   memset(&stats,0,sizeof(stats));
+   if (!root)
+      return;
+   std::vector<StatsFrame> stack;
+   visitChild(stats,stack,root,0);
+   double skewSum=0,fitErrorSum=0;
+   while (!stack.empty()) {
+      StatsFrame frame=stack.back();
+      stack.pop_back();
+      Node* node=frame.node;
+      unsigned level=frame.level;
+      unsigned fanout=0;
+      stats.nodes[node->type]++;
+      stats.bytes[node->type]+=nodeSize(node);
+      stats.levelNodes[std::min(level,STATS_MAX_LEVEL-1)][node->type]++;
+      stats.prefixLength[std::min(node->prefixLength,STATS_MAX_PREFIX)]++;
+      stats.height=std::max(stats.height,level+1);
+      if (node->fallback)
+         stats.linearFallback[node->type]++;
+      switch (node->type) {
+         case NodeType4: {
+            Node4* n=static_cast<Node4*>(node);
+            for (;fanout<n->count;fanout++)
+               visitChild(stats,stack,n->child[fanout],level+1);
+            break;
+         }
+         case NodeType16: {
+            Node16* n=static_cast<Node16*>(node);
+            for (;fanout<n->count;fanout++)
+               visitChild(stats,stack,n->child[fanout],level+1);
+            break;
+         }
+         case NodeType32: {
+            Node32* n=static_cast<Node32*>(node);
+            for (;fanout<n->count;fanout++)
+               visitChild(stats,stack,n->child[fanout],level+1);
+            break;
+         }
+         case NodeType48: {
+            Node48* n=static_cast<Node48*>(node);
+            for (unsigned i=0;i<NODE48_SIZE&&fanout<n->count;i++)
+               if (n->child[i]) {
+                  visitChild(stats,stack,n->child[i],level+1);
+                  fanout++;
+               }
+            break;
+         }
+         case NodeType256: {
+            Node256* n=static_cast<Node256*>(node);
+            for (unsigned i=0;i<256&&fanout<n->count;i++)
+               if (n->child[i]) {
+                  visitChild(stats,stack,n->child[i],level+1);
+                  fanout++;
+               }
+            break;
+         }
+         case NodeTypeLinear: {
+            NodeLinear* n=static_cast<NodeLinear*>(node);
+            uint32_t fullest=0;
+            for (unsigned i=0;i<n->fanout;i++) {
+               fullest=std::max(fullest,linearOccupancy(n)[i]);
+               if (linearChildren(n)[i]) {
+                  visitChild(stats,stack,linearChildren(n)[i],level+1);
+                  fanout++;
+               } else {
+                  stats.linearEmptyBuckets++;
+               }
+            }
+            if (n->size) {
+               double skew=static_cast<double>(fullest)*n->fanout/n->size;
+               stats.linearSkew[std::min(static_cast<unsigned>(skew),STATS_SKEW_BUCKETS-1)]++;
+               stats.linearSkewMax=std::max(stats.linearSkewMax,skew);
+               skewSum+=skew;
+            }
+            stats.linearMisses+=n->misses;
+            stats.linearFitErrorMax=std::max<double>(stats.linearFitErrorMax,n->fitError);
+            fitErrorSum+=n->fitError;
+            stats.linearFanout[linearFanoutClass(n->fanout)]++;
+            stats.linearKeyBytes[n->keyBytes]++;
+            break;
+         }
+         case NodeTypeLazy:
+            stats.lazyKeys+=static_cast<NodeLazy*>(node)->size;
+            break;
+      }
+      stats.children[node->type]+=fanout;
+      stats.fanout[node->type][std::min(fanout,256u)]++;
    }
-}
-
-void travelNode16(Node16* node, int depth, int nodes[5], int mode) {
-   for(int i=0; i < 16; i++) {
-      if(mode == CHILDREN_NODES && (isLeaf(node->child[i]) || node->child[i] != NULL)) nodes[node->type]++;
-      travel(node->child[i], depth+node->prefixLength, nodes, mode);
+   if (stats.nodes[NodeTypeLinear]) {
+      stats.linearSkewMean=skewSum/stats.nodes[NodeTypeLinear];
+      stats.linearFitErrorMean=fitErrorSum/stats.nodes[NodeTypeLinear];
    }
 }
 
-void travelNode48(Node48* node, int depth, int nodes[5], int mode) {
-   for(int i=0; i < NODE48_SIZE; i++) {
-      if(mode == CHILDREN_NODES && (isLeaf(node->child[i]) || node->child[i] != NULL)) nodes[node->type]++;
-      travel(node->child[i], depth+node->prefixLength, nodes, mode);
+void printStatsJSON(const TreeStats& stats,FILE* out) {
+   // One JSON object; histograms are arrays indexed by level, prefix length
+   // or skew, fanout histograms are objects keyed by child count
+   fprintf(out,"{\"leaves\":%zu,\"lazyKeys\":%zu,\"height\":%u,\"nodes\":{",stats.leaves,stats.lazyKeys,stats.height);
+   for (int8_t t=0;t<NodeTypeCount;t++)
+      fprintf(out,"%s\"%s\":%zu",t?",":"",nodeTypeNames[t],stats.nodes[t]);
+   fprintf(out,"},\"bytes\":{");
+   for (int8_t t=0;t<NodeTypeCount;t++)
+      fprintf(out,"%s\"%s\":%zu",t?",":"",nodeTypeNames[t],stats.bytes[t]);
+   fprintf(out,"},\"children\":{");
+   for (int8_t t=0;t<NodeTypeCount;t++)
+      fprintf(out,"%s\"%s\":%zu",t?",":"",nodeTypeNames[t],stats.children[t]);
+   fprintf(out,"},\"levelNodes\":[");
+   unsigned levels=std::min(stats.height,STATS_MAX_LEVEL);
+   for (unsigned l=0;l<levels;l++) {
+      fprintf(out,"%s{",l?",":"");
+      for (int8_t t=0;t<NodeTypeCount;t++)
+         fprintf(out,"%s\"%s\":%zu",t?",":"",nodeTypeNames[t],stats.levelNodes[l][t]);
+      fprintf(out,"}");
+   }
+   fprintf(out,"],\"leafLevel\":[");
+   for (unsigned l=0;l<levels;l++)
+      fprintf(out,"%s%zu",l?",":"",stats.leafLevel[l]);
+   fprintf(out,"],\"fanout\":{");
+   for (int8_t t=0;t<NodeTypeCount;t++) {
+      fprintf(out,"%s\"%s\":{",t?",":"",nodeTypeNames[t]);
+      bool first=true;
+      for (unsigned f=0;f<=256;f++)
+         if (stats.fanout[t][f]) {
+            fprintf(out,"%s\"%u\":%zu",first?"":",",f,stats.fanout[t][f]);
+            first=false;
+         }
+      fprintf(out,"}");
    }
+   fprintf(out,"},\"prefixLength\":[");
+   for (unsigned p=0;p<=STATS_MAX_PREFIX;p++)
+      fprintf(out,"%s%zu",p?",":"",stats.prefixLength[p]);
+   fprintf(out,"],\"linear\":{\"skew\":[");
+   for (unsigned s=0;s<STATS_SKEW_BUCKETS;s++)
+      fprintf(out,"%s%zu",s?",":"",stats.linearSkew[s]);
+   fprintf(out,"],\"skewMean\":%.3f,\"skewMax\":%.3f,\"emptyBuckets\":%zu,\"misses\":%zu,\"fanout\":{",stats.linearSkewMean,stats.linearSkewMax,stats.linearEmptyBuckets,stats.linearMisses);
+   for (unsigned c=0;c<LINEAR_FANOUT_CLASSES;c++)
+      fprintf(out,"%s\"%u\":%zu",c?",":"",LINEAR_MIN_FANOUT<<c,stats.linearFanout[c]);
+   fprintf(out,"},\"keyBytes\":[");
+   for (unsigned b=1;b<=LINEAR_MAX_KEY_BYTES;b++)
+      fprintf(out,"%s%zu",b>1?",":"",stats.linearKeyBytes[b]);
+   fprintf(out,"],\"fitErrorMean\":%.3f,\"fitErrorMax\":%.3f,\"fallback\":{",stats.linearFitErrorMean,stats.linearFitErrorMax);
+   for (int8_t t=0;t<NodeTypeCount;t++)
+      fprintf(out,"%s\"%s\":%zu",t?",":"",nodeTypeNames[t],stats.linearFallback[t]);
+   fprintf(out,"}}}\n");
 }
 
-void travelNode256(Node256* node, int depth, int nodes[5], int mode) {
-   for(int i=0; i < 256; i++) {
-      if(mode == CHILDREN_NODES && (isLeaf(node->child[i]) || node->child[i] != NULL)) nodes[node->type]++;
-      travel(node->child[i], depth+node->prefixLength, nodes, mode);
+void printStatsCSV(const TreeStats& stats,FILE* out) {
+   // Long format, one metric per row: metric,type,bucket,value; empty
+   // histogram buckets are left out
+   fprintf(out,"metric,type,bucket,value\n");
+   fprintf(out,"leaves,,,%zu\n",stats.leaves);
+   fprintf(out,"lazyKeys,,,%zu\n",stats.lazyKeys);
+   fprintf(out,"height,,,%u\n",stats.height);
+   for (int8_t t=0;t<NodeTypeCount;t++) {
+      fprintf(out,"nodes,%s,,%zu\n",nodeTypeNames[t],stats.nodes[t]);
+      fprintf(out,"bytes,%s,,%zu\n",nodeTypeNames[t],stats.bytes[t]);
+      fprintf(out,"children,%s,,%zu\n",nodeTypeNames[t],stats.children[t]);
+   }
+   unsigned levels=std::min(stats.height,STATS_MAX_LEVEL);
+   for (unsigned l=0;l<levels;l++) {
+      for (int8_t t=0;t<NodeTypeCount;t++)
+         if (stats.levelNodes[l][t])
+            fprintf(out,"levelNodes,%s,%u,%zu\n",nodeTypeNames[t],l,stats.levelNodes[l][t]);
+      if (stats.leafLevel[l])
+         fprintf(out,"leafLevel,,%u,%zu\n",l,stats.leafLevel[l]);
    }
+   for (int8_t t=0;t<NodeTypeCount;t++)
+      for (unsigned f=0;f<=256;f++)
+         if (stats.fanout[t][f])
+            fprintf(out,"fanout,%s,%u,%zu\n",nodeTypeNames[t],f,stats.fanout[t][f]);
+   for (unsigned p=0;p<=STATS_MAX_PREFIX;p++)
+      if (stats.prefixLength[p])
+         fprintf(out,"prefixLength,,%u,%zu\n",p,stats.prefixLength[p]);
+   for (unsigned s=0;s<STATS_SKEW_BUCKETS;s++)
+      if (stats.linearSkew[s])
+         fprintf(out,"linearSkew,linear,%u,%zu\n",s,stats.linearSkew[s]);
+   fprintf(out,"linearSkewMean,linear,,%.3f\n",stats.linearSkewMean);
+   fprintf(out,"linearSkewMax,linear,,%.3f\n",stats.linearSkewMax);
+   fprintf(out,"linearEmptyBuckets,linear,,%zu\n",stats.linearEmptyBuckets);
+   fprintf(out,"linearMisses,linear,,%zu\n",stats.linearMisses);
+   for (unsigned c=0;c<LINEAR_FANOUT_CLASSES;c++)
+      if (stats.linearFanout[c])
+         fprintf(out,"linearFanout,linear,%u,%zu\n",LINEAR_MIN_FANOUT<<c,stats.linearFanout[c]);
+   for (unsigned b=1;b<=LINEAR_MAX_KEY_BYTES;b++)
+      if (stats.linearKeyBytes[b])
+         fprintf(out,"linearKeyBytes,linear,%u,%zu\n",b,stats.linearKeyBytes[b]);
+   fprintf(out,"linearFitErrorMean,linear,,%.3f\n",stats.linearFitErrorMean);
+   fprintf(out,"linearFitErrorMax,linear,,%.3f\n",stats.linearFitErrorMax);
+   for (int8_t t=0;t<NodeTypeCount;t++)
+      if (stats.linearFallback[t])
+         fprintf(out,"linearFallback,%s,,%zu\n",nodeTypeNames[t],stats.linearFallback[t]);
 }
 
-void travelNodeLinear(NodeLinear* node, int depth, int nodes[5], int mode) {
-   // printf("linear node found\n");
-   for(int i=0; i<LINEAR_SIZE; i++) {
-      if(mode == CHILDREN_NODES && (isLeaf(node->child[i]) || node->child[i] != NULL)) nodes[node->type]++;
-      travel(node->child[i], depth+node->prefixLength, nodes, mode);
+MemoryUsage memoryUsage(Node* node) {
+   // Bytes used by the inner nodes of the tree per node type, as counted by
+   // collectStats
+   MemoryUsage usage;
+   TreeStats stats;
+   collectStats(node,stats);
+   usage.total=0;
+   for(int i=0; i<NodeTypeCount; i++) {
+      usage.nodes[i]=stats.nodes[i];
+      usage.bytes[i]=stats.bytes[i];
+      usage.total+=usage.bytes[i];
    }
+   return usage;
 }
 
+size_t arenaMemory(Arena* arena) {
+   // Bytes of pages an arena holds, including free slots
+   size_t bytes=0;
+   for (unsigned p=0;p<ARENA_POOLS;p++)
+      bytes+=arena->pools[p].pageCount*pageBytes(arena->pools[p]);
+   return bytes;
+}
 
-void profile(Node* node) {
-   // travel
-   // desired output:
-   // x nodes of each type
-   // average use of each node
-   // number of nodes at each lyaer
-   // 
-   int nodes[5] = {0, 0, 0, 0, 0};
-   travel(node, 0, nodes, COUNT_NODES);
-   printf("counting nodes\n");
-
-   int children[5] = {0, 0, 0, 0, 0};
-   travel(node, 0, children, CHILDREN_NODES);
-   printf("counting children\n");
-
-   for(int i=0; i<5; i++) {
-      printf("node type %d has %d nodes and total %d children, for an average of %f children per node\n", i, nodes[i], children[i], children[i]*1.0/nodes[i]);
+void profile(Node* node,FILE* out) {
+   // Human-readable summary of collectStats to out: nodes of each type,
+   // their average use and the nodes at each level
+   TreeStats stats;
+   collectStats(node,stats);
+   size_t total=0;
+   for(int i=0; i<NodeTypeCount; i++) {
+      size_t bytes=stats.bytes[i];
+      total+=bytes;
+      fprintf(out,"node type %d has %zu nodes and total %zu children, for an average of %f children per node, using %zu bytes\n", i, stats.nodes[i], stats.children[i], stats.nodes[i]?stats.children[i]*1.0/stats.nodes[i]:0.0, bytes);
+   }
+   for(unsigned l=0; l<std::min(stats.height,STATS_MAX_LEVEL); l++) {
+      fprintf(out,"level %u:", l);
+      for(int i=0; i<NodeTypeCount; i++)
+         fprintf(out," %zu", stats.levelNodes[l][i]);
+      fprintf(out," nodes, %zu leaves\n", stats.leafLevel[l]);
    }
+   if (stats.nodes[NodeTypeLinear])
+      fprintf(out,"linear skew mean %f max %f, %zu empty buckets, fit error mean %f max %f\n", stats.linearSkewMean, stats.linearSkewMax, stats.linearEmptyBuckets, stats.linearFitErrorMean, stats.linearFitErrorMax);
+   size_t fallbacks=0;
+   for(int i=0; i<NodeTypeCount; i++)
+      fallbacks+=stats.linearFallback[i];
+   if (fallbacks) {
+      fprintf(out,"classic instead of linear:");
+      for(int i=0; i<NodeTypeCount; i++)
+         fprintf(out," %zu", stats.linearFallback[i]);
+      fprintf(out," nodes\n");
+   }
+   fprintf(out,"total memory %zu bytes\n", total);
 }
 
+#ifdef ART_VISIT_COUNTERS
+thread_local uint64_t lookupVisits[NodeTypeCount];
+#endif
+
 Node* lookup(Node* node,uint8_t key[],unsigned keyLength,unsigned depth,unsigned maxKeyLength) {
    // Find the node with a matching key, optimistic version
 
@@ -329,11 +947,10 @@ Node* lookup(Node* node,uint8_t key[],unsigned keyLength,unsigned depth,unsigned
 
       if (node->prefixLength) {
          // printf("prefixLength\n");
-         if (node->prefixLength<maxPrefixLength) {
-            for (unsigned pos=0;pos<node->prefixLength;pos++)
-               if (key[depth+pos]!=node->prefix[pos])
-                  return NULL;
-         } else
+         // Compare the stored part, the rest is verified at the leaf
+         if (matchPrefix(node,key,depth,keyLength)<std::min(node->prefixLength,maxPrefixLength))
+            return NULL;
+         if (node->prefixLength>maxPrefixLength)
             skippedPrefix=true;
          depth+=node->prefixLength;
       }
@@ -341,8 +958,10 @@ Node* lookup(Node* node,uint8_t key[],unsigned keyLength,unsigned depth,unsigned
       // printf("depth: %d\n", depth);
 
       unsigned type = node->type;
-      node=*findChild(node,key[depth]);
-      if(type != 4) depth++;
+      COUNT_VISIT(type);
+      node=loadLazy(findChild(node,key+depth));
+      if (type!=NodeTypeLinear)
+         depth++;
    }
 
    return NULL;
@@ -362,124 +981,753 @@ Node* lookupPessimistic(Node* node,uint8_t key[],unsigned keyLength,unsigned dep
          return NULL; else
          depth+=node->prefixLength;
 
-      node=*findChild(node,key[depth]);
-      depth++;
+      // A NodeLinear routes on the key byte without consuming it
+      unsigned type=node->type;
+      node=loadLazy(findChild(node,key+depth));
+      if (type!=NodeTypeLinear)
+         depth++;
    }
 
    return NULL;
 }
 
-// Forward references
-void insertNode4(Node4* node,Node** nodeRef,uint8_t keyByte,Node* child);
-void insertNode16(Node16* node,Node** nodeRef,uint8_t keyByte,Node* child);
-void insertNode48(Node48* node,Node** nodeRef,uint8_t keyByte,Node* child);
-void insertNode256(Node256* node,Node** nodeRef,uint8_t keyByte,Node* child);
-
-unsigned min(unsigned a,unsigned b) {
-   // Helper function
-   return (a<b)?a:b;
-}
-
-void copyPrefix(Node* src,Node* dst) {
-   // Helper function that copies the prefix from the source to the destination node
-   dst->prefixLength=src->prefixLength;
-   memcpy(dst->prefix,src->prefix,min(src->prefixLength,maxPrefixLength));
-}
-
-void insert(Node* node,Node** nodeRef,uint8_t key[],unsigned depth,uintptr_t value,unsigned maxKeyLength) {
-   // Insert the leaf value into the tree
-   // printf("depth: %d\n", depth);
+// Number of lookups lookupBatch keeps in flight
+static const unsigned LOOKUP_BATCH_GROUP=16;
+
+struct LookupState {
+   // An in-flight lookup of lookupBatch
+   Node* node;
+   size_t index; // position in the batch, SIZE_MAX if the slot is idle
+   unsigned depth;
+   bool skippedPrefix;
+   alignas(8) uint8_t key[8];
+};
+
+static inline bool lookupStep(LookupState& state,Node** out) {
+   // Advance one lookup by one node (same logic as lookup), prefetch the
+   // next node. Returns true once the result is stored in out.
+   Node* node=state.node;
    if (node==NULL) {
-      *nodeRef=makeLeaf(value);
-      return;
+      out[state.index]=NULL;
+      return true;
    }
 
    if (isLeaf(node)) {
-      // Replace leaf with Node4 and store both leaves in it
-      // printf("insert: ");
-      // printkey(key);
-      uint8_t existingKey[maxKeyLength];
-      loadKey(getLeafValue(node),existingKey);
-      unsigned newPrefixLength=0;
-      while (existingKey[depth+newPrefixLength]==key[depth+newPrefixLength])
-         newPrefixLength++;
-
-      Node4* newNode=new Node4();
-      newNode->prefixLength=newPrefixLength;
-      memcpy(newNode->prefix,key+depth,min(newPrefixLength,maxPrefixLength));
-      *nodeRef=newNode;
-
-      // printf("newPrefixLength: %d\n", newPrefixLength);
-      insertNode4(newNode,nodeRef,existingKey[depth+newPrefixLength],node);
-      insertNode4(newNode,nodeRef,key[depth+newPrefixLength],makeLeaf(value));
-      return;
+      if (state.skippedPrefix||state.depth!=8) {
+         uint8_t leafKey[8];
+         loadKey(getLeafValue(node),leafKey);
+         for (unsigned i=(state.skippedPrefix?0:state.depth);i<8;i++)
+            if (leafKey[i]!=state.key[i]) {
+               node=NULL;
+               break;
+            }
+      }
+      out[state.index]=node;
+      return true;
    }
 
-   // Handle prefix of inner node
    if (node->prefixLength) {
-      unsigned mismatchPos=prefixMismatch(node,key,depth,maxKeyLength);
-      if (mismatchPos!=node->prefixLength) {
-         // Prefix differs, create new node
-         Node4* newNode=new Node4();
-         *nodeRef=newNode;
-         newNode->prefixLength=mismatchPos;
-         memcpy(newNode->prefix,node->prefix,min(mismatchPos,maxPrefixLength));
-         // Break up prefix
-         if (node->prefixLength<maxPrefixLength) {
-            insertNode4(newNode,nodeRef,node->prefix[mismatchPos],node);
-            node->prefixLength-=(mismatchPos+1);
-            memmove(node->prefix,node->prefix+mismatchPos+1,min(node->prefixLength,maxPrefixLength));
-         } else {
-            node->prefixLength-=(mismatchPos+1);
-            uint8_t minKey[maxKeyLength];
-            loadKey(getLeafValue(minimum(node)),minKey);
-            insertNode4(newNode,nodeRef,minKey[depth+mismatchPos],node);
-            memmove(node->prefix,minKey+depth+mismatchPos+1,min(node->prefixLength,maxPrefixLength));
-         }
-         insertNode4(newNode,nodeRef,key[depth+mismatchPos],makeLeaf(value));
-         return;
+      if (matchPrefix(node,state.key,state.depth,8)<std::min(node->prefixLength,maxPrefixLength)) {
+         out[state.index]=NULL;
+         return true;
       }
-      depth+=node->prefixLength;
+      if (node->prefixLength>maxPrefixLength)
+         state.skippedPrefix=true;
+      state.depth+=node->prefixLength;
    }
 
-   // Recurse
-   Node** child=findChild(node,key[depth]);
-   if (*child) {
-      insert(*child,child,key,depth+1,value,maxKeyLength);
-      return;
+   unsigned type=node->type;
+   COUNT_VISIT(type);
+   node=loadLazy(findChild(node,state.key+state.depth));
+   if (type!=NodeTypeLinear)
+      state.depth++;
+   if (node&&!isLeaf(node)) {
+      // Header (and the keys of small nodes) plus the following line
+      __builtin_prefetch(node);
+      __builtin_prefetch(reinterpret_cast<uint8_t*>(node)+64);
    }
+   state.node=node;
+   return false;
+}
 
-   // Insert leaf into inner node
-   Node* newNode=makeLeaf(value);
-   switch (node->type) {
-      case NodeType4: insertNode4(static_cast<Node4*>(node),nodeRef,key[depth],newNode); break;
-      case NodeType16: insertNode16(static_cast<Node16*>(node),nodeRef,key[depth],newNode); break;
-      case NodeType48: insertNode48(static_cast<Node48*>(node),nodeRef,key[depth],newNode); break;
-      case NodeType256: insertNode256(static_cast<Node256*>(node),nodeRef,key[depth],newNode); break;
+static inline void lookupStart(LookupState& state,Node* root,const uint64_t* keys,size_t index) {
+   state.node=root;
+   state.index=index;
+   state.depth=0;
+   state.skippedPrefix=false;
+   loadKeyUInt64(keys[index],state.key);
+}
+
+void lookupBatch(Node* root,const uint64_t* keys,size_t n,Node** out) {
+   // Look up n 8-byte keys (out[i] is the leaf of keys[i] or NULL). The
+   // traversals are interleaved AMAC-style: a round-robin over
+   // LOOKUP_BATCH_GROUP in-flight lookups advances each by one node per
+   // visit, so the prefetch of the next node overlaps with the work on
+   // the others; a finished slot immediately starts the next key.
+   LookupState states[LOOKUP_BATCH_GROUP];
+   size_t next=0;
+   unsigned active=0;
+   for (unsigned s=0;s<LOOKUP_BATCH_GROUP;s++) {
+      if (next<n) {
+         lookupStart(states[s],root,keys,next++);
+         active++;
+      } else
+         states[s].index=SIZE_MAX;
+   }
+
+   while (active) {
+      for (unsigned s=0;s<LOOKUP_BATCH_GROUP;s++) {
+         LookupState& state=states[s];
+         if (state.index==SIZE_MAX||!lookupStep(state,out))
+            continue;
+         if (next<n)
+            lookupStart(state,root,keys,next++);
+         else {
+            state.index=SIZE_MAX;
+            active--;
+         }
+      }
    }
 }
 
-void insertNode4(Node4* node,Node** nodeRef,uint8_t keyByte,Node* child) {
-   // Insert leaf into inner node
-   if (node->count<NODE4_SIZE) {
-      // Insert element
-      unsigned pos;
-      for (pos=0;(pos<node->count)&&(node->key[pos]<keyByte);pos++);
-      memmove(node->key+pos+1,node->key+pos,node->count-pos);
-      memmove(node->child+pos+1,node->child+pos,(node->count-pos)*sizeof(uintptr_t));
-      node->key[pos]=keyByte;
+static int slotAfter(Node* n,int pos) {
+   // First non-empty child slot after pos in key order, -1 if there is none.
+   // Slots are indexes for Node4/Node16/Node32 (keys are sorted), key bytes
+   // for Node48/Node256 and buckets for NodeLinear (buckets are monotone in
+   // the key byte).
+   switch (n->type) {
+      case NodeType4:
+      case NodeType16:
+      case NodeType32:
+         return (pos+1<n->count)?pos+1:-1;
+      case NodeType48:
+         return firstIndex(static_cast<Node48*>(n)->childIndex,pos+1);
+      case NodeType256:
+         return firstChild(static_cast<Node256*>(n)->child,pos+1,256);
+      case NodeTypeLinear: {
+         NodeLinear* node=static_cast<NodeLinear*>(n);
+         return firstChild(linearChildren(node),pos+1,node->fanout);
+      }
+   }
+   throw; // Unreachable
+}
+
+// Slot position past the last slot of every node type
+static const int SLOT_END=LINEAR_MAX_FANOUT;
+
+static int slotBefore(Node* n,int pos) {
+   // Last non-empty child slot before pos in key order, -1 if there is none
+   switch (n->type) {
+      case NodeType4:
+      case NodeType16:
+      case NodeType32:
+         return std::min(pos,(int)n->count)-1;
+      case NodeType48:
+         return lastIndex(static_cast<Node48*>(n)->childIndex,std::min(pos,256));
+      case NodeType256:
+         return lastChild(static_cast<Node256*>(n)->child,std::min(pos,256));
+      case NodeTypeLinear: {
+         NodeLinear* node=static_cast<NodeLinear*>(n);
+         return lastChild(linearChildren(node),std::min(pos,(int)node->fanout));
+      }
+   }
+   throw; // Unreachable
+}
+
+static Node* slotChild(Node* n,int pos) {
+   // Child stored in a slot returned by slotAfter/slotBefore, built first
+   // if it is lazy
+   switch (n->type) {
+      case NodeType4: return loadLazy(&static_cast<Node4*>(n)->child[pos]);
+      case NodeType16: return loadLazy(&static_cast<Node16*>(n)->child[pos]);
+      case NodeType32: return loadLazy(&static_cast<Node32*>(n)->child[pos]);
+      case NodeType48: {
+         Node48* node=static_cast<Node48*>(n);
+         return loadLazy(&node->child[node->childIndex[pos]]);
+      }
+      case NodeType256: return loadLazy(&static_cast<Node256*>(n)->child[pos]);
+      case NodeTypeLinear: return loadLazy(&linearChildren(static_cast<NodeLinear*>(n))[pos]);
+   }
+   throw; // Unreachable
+}
+
+static bool descendMinimum(Iterator& it,Node* node) {
+   // Position the iterator on the smallest leaf below node, like minimum
+   while (!isLeaf(node)) {
+      IteratorFrame frame={node,slotAfter(node,-1)};
+      it.stack.push_back(frame);
+      node=slotChild(node,frame.pos);
+   }
+   it.leaf=node;
+   return true;
+}
+
+static bool descendMaximum(Iterator& it,Node* node) {
+   // Position the iterator on the largest leaf below node, like maximum
+   while (!isLeaf(node)) {
+      IteratorFrame frame={node,slotBefore(node,SLOT_END)};
+      it.stack.push_back(frame);
+      node=slotChild(node,frame.pos);
+   }
+   it.leaf=node;
+   return true;
+}
+
+bool seekMinimum(Node* root,Iterator& it) {
+   it.stack.clear();
+   it.leaf=NULL;
+   return root&&descendMinimum(it,root);
+}
+
+bool seekMaximum(Node* root,Iterator& it) {
+   it.stack.clear();
+   it.leaf=NULL;
+   return root&&descendMaximum(it,root);
+}
+
+bool next(Iterator& it) {
+   // Advance to the next leaf in key order, false at the end
+   while (!it.stack.empty()) {
+      IteratorFrame& top=it.stack.back();
+      int pos=slotAfter(top.node,top.pos);
+      if (pos>=0) {
+         top.pos=pos;
+         return descendMinimum(it,slotChild(top.node,pos));
+      }
+      it.stack.pop_back();
+   }
+   it.leaf=NULL;
+   return false;
+}
+
+bool prev(Iterator& it) {
+   // Step back to the previous leaf in key order, false at the beginning
+   while (!it.stack.empty()) {
+      IteratorFrame& top=it.stack.back();
+      int pos=slotBefore(top.node,top.pos);
+      if (pos>=0) {
+         top.pos=pos;
+         return descendMaximum(it,slotChild(top.node,pos));
+      }
+      it.stack.pop_back();
+   }
+   it.leaf=NULL;
+   return false;
+}
+
+static int comparePrefix(Node* node,uint8_t key[],unsigned depth,unsigned maxKeyLength) {
+   // Compare the prefix of node with the key bytes at depth (<0, 0, >0).
+   // Prefixes longer than the header are taken from the minimum leaf.
+   unsigned pos=prefixMismatch(node,key,depth,maxKeyLength);
+   if (pos==node->prefixLength)
+      return 0;
+   uint8_t byte;
+   if (pos<maxPrefixLength) {
+      byte=node->prefix[pos];
+   } else {
+      uint8_t minKey[maxKeyLength];
+      loadKey(getLeafValue(minimum(node)),minKey);
+      byte=minKey[depth+pos];
+   }
+   return (byte<key[depth+pos])?-1:1;
+}
+
+bool lowerBound(Node* root,uint8_t key[],unsigned keyLength,unsigned maxKeyLength,Iterator& it) {
+   // Position the iterator on the first leaf whose key is >= key, false if
+   // there is none. Whenever a subtree turns out to hold only smaller keys
+   // the search continues with next() from the frames above it.
+   it.stack.clear();
+   it.leaf=NULL;
+   Node* node=root;
+   unsigned depth=0;
+   while (node) {
+      if (isLeaf(node)) {
+         uint8_t leafKey[maxKeyLength];
+         loadKey(getLeafValue(node),leafKey);
+         it.leaf=node;
+         if (memcmp(leafKey,key,keyLength)>=0)
+            return true;
+         return next(it);
+      }
+
+      if (node->prefixLength) {
+         int cmp=comparePrefix(node,key,depth,maxKeyLength);
+         if (cmp>0)
+            return descendMinimum(it,node);
+         if (cmp<0)
+            return next(it);
+         depth+=node->prefixLength;
+      }
+
+      uint8_t keyByte=key[depth];
+      IteratorFrame frame={node,-1};
+      switch (node->type) {
+         case NodeType4: {
+            Node4* n=static_cast<Node4*>(node);
+            while (frame.pos+1<n->count&&n->key[frame.pos+1]<keyByte)
+               frame.pos++;
+            break;
+         }
+         case NodeType16: {
+            Node16* n=static_cast<Node16*>(node);
+            while (frame.pos+1<n->count&&flipSign(n->key[frame.pos+1])<keyByte)
+               frame.pos++;
+            break;
+         }
+         case NodeType32: {
+            Node32* n=static_cast<Node32*>(node);
+            while (frame.pos+1<n->count&&flipSign(n->key[frame.pos+1])<keyByte)
+               frame.pos++;
+            break;
+         }
+         case NodeType48:
+         case NodeType256:
+            frame.pos=keyByte-1;
+            break;
+         case NodeTypeLinear:
+            frame.pos=linearBucket(static_cast<NodeLinear*>(node),key+depth)-1;
+            break;
+      }
+      // frame.pos is now right before the slots that may hold keys >= key
+      int pos=slotAfter(node,frame.pos);
+      if (pos<0)
+         return next(it);
+      frame.pos=pos;
+      it.stack.push_back(frame);
+
+      Node* child=slotChild(node,pos);
+      bool exact;
+      switch (node->type) {
+         case NodeType4: exact=static_cast<Node4*>(node)->key[pos]==keyByte; break;
+         case NodeType16: exact=flipSign(static_cast<Node16*>(node)->key[pos])==keyByte; break;
+         case NodeType32: exact=flipSign(static_cast<Node32*>(node)->key[pos])==keyByte; break;
+         case NodeTypeLinear:
+            // The bucket can hold smaller and larger key bytes
+            exact=(unsigned)pos==linearBucket(static_cast<NodeLinear*>(node),key+depth);
+            break;
+         default: exact=pos==keyByte; break;
+      }
+      if (!exact)
+         return descendMinimum(it,child);
+      // A NodeLinear does not consume the key byte
+      if (node->type!=NodeTypeLinear)
+         depth++;
+      node=child;
+   }
+   return false;
+}
+
+bool upperBound(Node* root,uint8_t key[],unsigned keyLength,unsigned maxKeyLength,Iterator& it) {
+   // Position the iterator on the first leaf whose key is > key
+   if (!lowerBound(root,key,keyLength,maxKeyLength,it))
+      return false;
+   uint8_t leafKey[maxKeyLength];
+   loadKey(getLeafValue(it.leaf),leafKey);
+   if (memcmp(leafKey,key,keyLength)==0)
+      return next(it);
+   return true;
+}
+
+void collectLeaves(Node* node,std::vector<uint64_t>& values) {
+   // Append the values of all leaves below node in key order
+   if (!node)
+      return;
+   if (isLeaf(node)) {
+      values.push_back(getLeafValue(node));
+      return;
+   }
+   switch (node->type) {
+      case NodeType4: {
+         Node4* n=static_cast<Node4*>(node);
+         for (unsigned i=0;i<n->count;i++)
+            collectLeaves(n->child[i],values);
+         break;
+      }
+      case NodeType16: {
+         Node16* n=static_cast<Node16*>(node);
+         for (unsigned i=0;i<n->count;i++)
+            collectLeaves(n->child[i],values);
+         break;
+      }
+      case NodeType32: {
+         Node32* n=static_cast<Node32*>(node);
+         for (unsigned i=0;i<n->count;i++)
+            collectLeaves(n->child[i],values);
+         break;
+      }
+      case NodeType48: {
+         Node48* n=static_cast<Node48*>(node);
+         for (unsigned i=0;i<256;i++)
+            if (n->childIndex[i]!=emptyMarker)
+               collectLeaves(n->child[n->childIndex[i]],values);
+         break;
+      }
+      case NodeType256: {
+         Node256* n=static_cast<Node256*>(node);
+         for (unsigned i=0;i<256;i++)
+            collectLeaves(n->child[i],values);
+         break;
+      }
+      case NodeTypeLinear: {
+         NodeLinear* n=static_cast<NodeLinear*>(node);
+         for (unsigned i=0;i<n->fanout;i++)
+            collectLeaves(linearChildren(n)[i],values);
+         break;
+      }
+      case NodeTypeLazy: {
+         NodeLazy* n=static_cast<NodeLazy*>(node);
+         values.insert(values.end(),n->keys,n->keys+n->size);
+         break;
+      }
+   }
+}
+
+static inline void pushInner(std::vector<Node*>& stack,Node* node) {
+   if (node&&!isLeaf(node))
+      stack.push_back(node);
+}
+
+void destroy(Node* root) {
+   // Free all inner nodes of the tree (leaves are not allocated), using an
+   // explicit stack. A tree that has an arena of its own is dropped faster
+   // with releaseArena.
+   std::vector<Node*> stack;
+   pushInner(stack,root);
+   while (!stack.empty()) {
+      Node* node=stack.back();
+      stack.pop_back();
+      switch (node->type) {
+         case NodeType4: {
+            Node4* n=static_cast<Node4*>(node);
+            for (unsigned i=0;i<n->count;i++)
+               pushInner(stack,n->child[i]);
+            break;
+         }
+         case NodeType16: {
+            Node16* n=static_cast<Node16*>(node);
+            for (unsigned i=0;i<n->count;i++)
+               pushInner(stack,n->child[i]);
+            break;
+         }
+         case NodeType32: {
+            Node32* n=static_cast<Node32*>(node);
+            for (unsigned i=0;i<n->count;i++)
+               pushInner(stack,n->child[i]);
+            break;
+         }
+         case NodeType48: {
+            Node48* n=static_cast<Node48*>(node);
+            for (unsigned i=0;i<NODE48_SIZE;i++)
+               pushInner(stack,n->child[i]);
+            break;
+         }
+         case NodeType256: {
+            Node256* n=static_cast<Node256*>(node);
+            for (unsigned i=0;i<256;i++)
+               pushInner(stack,n->child[i]);
+            break;
+         }
+         case NodeTypeLinear: {
+            NodeLinear* n=static_cast<NodeLinear*>(node);
+            for (unsigned i=0;i<n->fanout;i++)
+               pushInner(stack,linearChildren(n)[i]);
+            break;
+         }
+      }
+      freeNode(node);
+   }
+}
+
+void rebuildSubtree(Node** nodeRef,unsigned depth,unsigned maxKeyLength) {
+   // Replace the subtree by a freshly bulk-loaded one over the same keys
+   std::vector<uint64_t> values;
+   collectLeaves(*nodeRef,values);
+   destroy(*nodeRef);
+   *nodeRef=NULL;
+   insertBulk(NULL,nodeRef,values.data(),values.size(),depth,maxKeyLength);
+}
+
+// Forward references
+void insertNode4(Node4* node,Node** nodeRef,uint8_t keyByte,Node* child);
+void insertNode16(Node16* node,Node** nodeRef,uint8_t keyByte,Node* child);
+void insertNode32(Node32* node,Node** nodeRef,uint8_t keyByte,Node* child);
+void insertNode48(Node48* node,Node** nodeRef,uint8_t keyByte,Node* child);
+void insertNode256(Node256* node,Node** nodeRef,uint8_t keyByte,Node* child);
+void insertNodeLinear(NodeLinear* node,Node** nodeRef,uint8_t key[],Node* child);
+bool adaptNodeLinear(NodeLinear* node,Node** nodeRef,Node** child,uint8_t key[],unsigned depth,unsigned maxKeyLength);
+
+unsigned min(unsigned a,unsigned b) {
+   // Helper function
+   return (a<b)?a:b;
+}
+
+void copyPrefix(Node* src,Node* dst) {
+   // Helper function that copies the prefix from the source to the destination node
+   dst->prefixLength=src->prefixLength;
+   memcpy(dst->prefix,src->prefix,min(src->prefixLength,maxPrefixLength));
+}
+
+Node* grow(Node* node) {
+   // Copy a Node4/16/32/48 into a node of the next larger type, the old
+   // node is left untouched
+   switch (node->type) {
+      case NodeType4: {
+         Node4* n=static_cast<Node4*>(node);
+         Node16* newNode=allocNode<Node16>();
+         newNode->count=n->count;
+         copyPrefix(n,newNode);
+         for (unsigned i=0;i<n->count;i++)
+            newNode->key[i]=flipSign(n->key[i]);
+         memcpy(newNode->child,n->child,n->count*sizeof(uintptr_t));
+         return newNode;
+      }
+      case NodeType16: {
+         // Keys stay flipped and sorted
+         Node16* n=static_cast<Node16*>(node);
+         Node32* newNode=allocNode<Node32>();
+         newNode->count=n->count;
+         copyPrefix(n,newNode);
+         memcpy(newNode->key,n->key,n->count);
+         memcpy(newNode->child,n->child,n->count*sizeof(uintptr_t));
+         return newNode;
+      }
+      case NodeType32: {
+         // A Node256 served here before Node48 was used
+         Node32* n=static_cast<Node32*>(node);
+         Node48* newNode=allocNode<Node48>();
+         memcpy(newNode->child,n->child,n->count*sizeof(uintptr_t));
+         for (unsigned i=0;i<n->count;i++)
+            newNode->childIndex[flipSign(n->key[i])]=i;
+         copyPrefix(n,newNode);
+         newNode->count=n->count;
+         return newNode;
+      }
+      case NodeType48: {
+         Node48* n=static_cast<Node48*>(node);
+         Node256* newNode=allocNode<Node256>();
+         for (unsigned i=0;i<256;i++)
+            if (n->childIndex[i]!=emptyMarker)
+               newNode->child[i]=n->child[n->childIndex[i]];
+         newNode->count=n->count;
+         copyPrefix(n,newNode);
+         return newNode;
+      }
+   }
+   throw; // Unreachable
+}
+
+Node4* expandLeaf(Node* leaf,uint8_t key[],unsigned depth,uintptr_t value,unsigned maxKeyLength) {
+   // New Node4 holding an existing leaf and the leaf for value, the caller
+   // links it into the tree
+   uint8_t existingKey[maxKeyLength];
+   loadKey(getLeafValue(leaf),existingKey);
+   return joinLeaves(leaf,existingKey,key,depth,value);
+}
+
+Node4* joinLeaves(Node* leaf,uint8_t existingKey[],uint8_t key[],unsigned depth,uintptr_t value) {
+   // expandLeaf for a leaf whose key is already loaded
+   unsigned newPrefixLength=0;
+   while (existingKey[depth+newPrefixLength]==key[depth+newPrefixLength])
+      newPrefixLength++;
+
+   Node4* newNode=allocNode<Node4>();
+   newNode->prefixLength=newPrefixLength;
+   memcpy(newNode->prefix,key+depth,min(newPrefixLength,maxPrefixLength));
+   // Two children never grow the Node4, so its own address serves as ref
+   Node* ref=newNode;
+   insertNode4(newNode,&ref,existingKey[depth+newPrefixLength],leaf);
+   insertNode4(newNode,&ref,key[depth+newPrefixLength],makeLeaf(value));
+   return newNode;
+}
+
+Node4* splitPrefix(Node* node,uint8_t key[],unsigned depth,unsigned mismatchPos,uintptr_t value,unsigned maxKeyLength) {
+   // New Node4 with the first mismatchPos prefix bytes of node and two
+   // children: node with the rest of its prefix and the leaf for value. The
+   // caller links it into the tree in place of node.
+   Node4* newNode=allocNode<Node4>();
+   Node* ref=newNode;
+   newNode->prefixLength=mismatchPos;
+   memcpy(newNode->prefix,node->prefix,min(mismatchPos,maxPrefixLength));
+   // Break up prefix
+   if (node->prefixLength<maxPrefixLength) {
+      insertNode4(newNode,&ref,node->prefix[mismatchPos],node);
+      node->prefixLength-=(mismatchPos+1);
+      memmove(node->prefix,node->prefix+mismatchPos+1,min(node->prefixLength,maxPrefixLength));
+   } else {
+      node->prefixLength-=(mismatchPos+1);
+      uint8_t minKey[maxKeyLength];
+      loadKey(getLeafValue(minimum(node)),minKey);
+      insertNode4(newNode,&ref,minKey[depth+mismatchPos],node);
+      memmove(node->prefix,minKey+depth+mismatchPos+1,min(node->prefixLength,maxPrefixLength));
+   }
+   insertNode4(newNode,&ref,key[depth+mismatchPos],makeLeaf(value));
+   return newNode;
+}
+
+// Linear nodes an insert or erase keeps on its own path stack, a longer
+// run of them is handled by a nested call
+static const unsigned PATH_MAX_LINEAR=16;
+
+// A linear node passed on the way down, with the bucket taken
+struct LinearStep {
+   NodeLinear* node;
+   Node** nodeRef;
+   Node** child;
+   // depth after the prefix of node
+   unsigned depth;
+   // frame of node in the hint path
+   size_t frame;
+};
+
+static void insertPath(Node** nodeRef,uint8_t key[],unsigned depth,unsigned routed,uintptr_t value,unsigned maxKeyLength,InsertHint* hint) {
+   // Iterative insert into the subtree at nodeRef (its node sits at depth,
+   // routed key bytes led to it). The linear nodes passed are adapted
+   // bottom-up once the leaf is in place; with a hint every child slot
+   // taken is appended to its path.
+   LinearStep steps[PATH_MAX_LINEAR];
+   unsigned stepCount=0;
+   for (;;) {
+      Node* node=*nodeRef;
+      if (hint)
+         hint->path.push_back({nodeRef,node,routed,depth});
+      if (node==NULL) {
+         *nodeRef=makeLeaf(value);
+         break;
+      }
+      if (isLeaf(node)) {
+         // Replace leaf with Node4 and store both leaves in it
+         *nodeRef=expandLeaf(node,key,depth,value,maxKeyLength);
+         break;
+      }
+
+      // Handle prefix of inner node
+      if (node->prefixLength) {
+         unsigned mismatchPos=prefixMismatch(node,key,depth,maxKeyLength);
+         if (mismatchPos!=node->prefixLength) {
+            // Prefix differs, create new node
+            *nodeRef=splitPrefix(node,key,depth,mismatchPos,value,maxKeyLength);
+            break;
+         }
+         depth+=node->prefixLength;
+      }
+
+      Node** child=findChild(node,key+depth);
+      bool linear=node->type==NodeTypeLinear;
+      if (linear)
+         steps[stepCount++]={static_cast<NodeLinear*>(node),nodeRef,child,depth,hint?hint->path.size()-1:0};
+      if (!loadLazy(child)) {
+         // Insert leaf into inner node
+         Node* newNode=makeLeaf(value);
+         switch (node->type) {
+            case NodeType4: insertNode4(static_cast<Node4*>(node),nodeRef,key[depth],newNode); break;
+            case NodeType16: insertNode16(static_cast<Node16*>(node),nodeRef,key[depth],newNode); break;
+            case NodeType32: insertNode32(static_cast<Node32*>(node),nodeRef,key[depth],newNode); break;
+            case NodeType48: insertNode48(static_cast<Node48*>(node),nodeRef,key[depth],newNode); break;
+            case NodeType256: insertNode256(static_cast<Node256*>(node),nodeRef,key[depth],newNode); break;
+            case NodeTypeLinear: insertNodeLinear(static_cast<NodeLinear*>(node),nodeRef,key+depth,newNode); break;
+         }
+         break;
+      }
+
+      // Descend, a NodeLinear does not consume the key byte
+      if (linear) {
+         routed=depth+static_cast<NodeLinear*>(node)->keyBytes;
+         if (stepCount==PATH_MAX_LINEAR) {
+            insertPath(child,key,depth,routed,value,maxKeyLength,hint);
+            break;
+         }
+      } else {
+         depth++;
+         routed=depth;
+      }
+      nodeRef=child;
+   }
+   // The last slot now holds the new leaf, or the node that replaced the
+   // one passed there
+   if (hint)
+      hint->path.back().node=*hint->path.back().ref;
+
+   while (stepCount--) {
+      LinearStep& step=steps[stepCount];
+      if (adaptNodeLinear(step.node,step.nodeRef,step.child,key+step.depth,step.depth,maxKeyLength)&&hint)
+         hint->path.resize(std::min(hint->path.size(),step.frame));
+   }
+}
+
+void insert(Node* node,Node** nodeRef,uint8_t key[],unsigned depth,uintptr_t value,unsigned maxKeyLength) {
+   // Insert the leaf value into the tree (node is *nodeRef, only checked)
+   assert(node==*nodeRef);
+   (void)node;
+   insertPath(nodeRef,key,depth,depth,value,maxKeyLength,NULL);
+}
+
+static void insertFrom(Node** root,uint8_t key[],unsigned depth,uintptr_t value,unsigned maxKeyLength,InsertHint& hint) {
+   // Insert like insert(*root,root,key,depth,value,maxKeyLength), but start
+   // at the deepest node of the previous hinted insert whose path the key
+   // shares. Inserts keep the path exact (nodes they replace are updated,
+   // frames below a rebuilt subtree are dropped), so only the resume frame
+   // is checked against the tree.
+   unsigned common=0;
+   if (hint.key.size()==maxKeyLength)
+      while (common<maxKeyLength&&hint.key[common]==key[common])
+         common++;
+   hint.key.assign(key,key+maxKeyLength);
+   size_t keep=0;
+   if (!hint.path.empty()&&hint.path[0].ref==root) {
+      // routed grows along the path
+      keep=hint.path.size();
+      while (keep&&hint.path[keep-1].routed>common)
+         keep--;
+      if (keep&&*hint.path[keep-1].ref!=hint.path[keep-1].node)
+         keep=0;
+   }
+   if (keep==0) {
+      hint.path.clear();
+      insertPath(root,key,depth,depth,value,maxKeyLength,&hint);
+      return;
+   }
+
+   // Resume at the last shared frame, insertPath records it again
+   hint.path.resize(keep);
+   InsertHintFrame resume=hint.path.back();
+   hint.path.pop_back();
+   insertPath(resume.ref,key,resume.depth,resume.routed,value,maxKeyLength,&hint);
+
+   // The linear nodes above the resumed frame still count the key
+   Node** child=resume.ref;
+   unsigned childDepth=resume.depth;
+   for (size_t i=keep-1;i-->0;) {
+      InsertHintFrame frame=hint.path[i];
+      if (frame.node&&!isLeaf(frame.node)&&frame.node->type==NodeTypeLinear)
+         if (adaptNodeLinear(static_cast<NodeLinear*>(frame.node),frame.ref,child,key+childDepth,childDepth,maxKeyLength))
+            hint.path.resize(std::min(hint.path.size(),i));
+      child=frame.ref;
+      childDepth=frame.depth;
+   }
+}
+
+void insertWithHint(Node** root,uint8_t key[],uintptr_t value,unsigned maxKeyLength,InsertHint& hint) {
+   // Insert the leaf value, resuming at the path of the previous insert
+   // with the same hint
+   insertFrom(root,key,0,value,maxKeyLength,hint);
+}
+
+void insertNode4(Node4* node,Node** nodeRef,uint8_t keyByte,Node* child) {
+   // Insert leaf into inner node
+   if (node->count<NODE4_SIZE) {
+      // Insert element
+      unsigned pos;
+      for (pos=0;(pos<node->count)&&(node->key[pos]<keyByte);pos++);
+      memmove(node->key+pos+1,node->key+pos,node->count-pos);
+      memmove(node->child+pos+1,node->child+pos,(node->count-pos)*sizeof(uintptr_t));
+      node->key[pos]=keyByte;
       node->child[pos]=child;
       node->count++;
    } else {
       // Grow to Node16
-      Node16* newNode=new Node16();
+      Node16* newNode=static_cast<Node16*>(grow(node));
       *nodeRef=newNode;
-      newNode->count=NODE4_SIZE;
-      copyPrefix(node,newNode);
-      for (unsigned i=0;i<NODE4_SIZE;i++)
-         newNode->key[i]=flipSign(node->key[i]);
-      memcpy(newNode->child,node->child,node->count*sizeof(uintptr_t));
-      delete node;
+      freeNode(node);
       return insertNode16(newNode,nodeRef,keyByte,child);
    }
 }
@@ -497,495 +1745,2076 @@ void insertNode16(Node16* node,Node** nodeRef,uint8_t keyByte,Node* child) {
       node->key[pos]=keyByteFlipped;
       node->child[pos]=child;
       node->count++;
+   } else {
+      // Grow to Node32
+      Node32* newNode=static_cast<Node32*>(grow(node));
+      *nodeRef=newNode;
+      freeNode(node);
+      return insertNode32(newNode,nodeRef,keyByte,child);
+   }
+}
+
+void insertNode32(Node32* node,Node** nodeRef,uint8_t keyByte,Node* child) {
+   // Insert leaf into inner node
+   if (node->count<32) {
+      // Insert element
+      uint8_t keyByteFlipped=flipSign(keyByte);
+      uint32_t bitfield=lessMask32(node->key,keyByteFlipped)&static_cast<uint32_t>((1ull<<node->count)-1);
+      unsigned pos=bitfield?__builtin_ctz(bitfield):node->count;
+      memmove(node->key+pos+1,node->key+pos,node->count-pos);
+      memmove(node->child+pos+1,node->child+pos,(node->count-pos)*sizeof(uintptr_t));
+      node->key[pos]=keyByteFlipped;
+      node->child[pos]=child;
+      node->count++;
    } else {
       // Grow to Node48
-      
-      Node48* newNode=new Node48();
+      Node48* newNode=static_cast<Node48*>(grow(node));
       *nodeRef=newNode;
-      memcpy(newNode->child,node->child,node->count*sizeof(uintptr_t));
-      for (unsigned i=0;i<node->count;i++)
-         newNode->childIndex[flipSign(node->key[i])]=i;
-      copyPrefix(node,newNode);
-      newNode->count=node->count;
-      delete node;
+      freeNode(node);
       return insertNode48(newNode,nodeRef,keyByte,child);
-      
+   }
+}
 
-      /*
-      Node256* newNode=new Node256();
-      *nodeRef=newNode;
-      for (unsigned i=0;i<node->count;i++){
-         newNode->child[flipSign(node->key[i])]=node->child[i];
+void insertNode48(Node48* node,Node** nodeRef,uint8_t keyByte,Node* child) {
+   // Insert leaf into inner node
+   if (node->count<NODE48_SIZE) {
+      // Insert element
+      unsigned pos=node->count;
+      if (node->child[pos])
+         for (pos=0;node->child[pos]!=NULL;pos++);
+      node->child[pos]=child;
+      node->childIndex[keyByte]=pos;
+      node->count++;
+   } else {
+      // Grow to Node256
+      Node256* newNode=static_cast<Node256*>(grow(node));
+      *nodeRef=newNode;
+      freeNode(node);
+      return insertNode256(newNode,nodeRef,keyByte,child);
+   }
+}
+
+void insertNode256(Node256* node,Node** nodeRef,uint8_t keyByte,Node* child) {
+   // Insert leaf into inner node
+   node->count++;
+   node->child[keyByte]=child;
+}
+
+void insertNodeLinear(NodeLinear* node,Node** nodeRef,uint8_t key[],Node* child) {
+   // Insert leaf into the predicted (empty) bucket for the key bytes at key,
+   // a linear node never grows
+   node->count++;
+   *findChild(node,key)=child;
+}
+
+static inline bool linearNeedsRetrain(NodeLinear* node) {
+   // The node doubled since its model was fit and is small enough to
+   // retrain
+   return node->size>=2*node->trained&&node->size<=LINEAR_RETRAIN_MAX;
+}
+
+static bool splitBucketLinear(NodeLinear* node,Node** child,unsigned depth,unsigned maxKeyLength) {
+   // Rebuild an overloaded bucket as a learned subtree, returns true if it
+   // was rebuilt
+   unsigned bucket=child-linearChildren(node);
+   if (linearOccupancy(node)[bucket]>LINEAR_OVERLOAD*node->size/node->fanout+LINEAR_REBUILD_MIN&&!isLeaf(*child)&&(*child)->type!=NodeTypeLinear) {
+      rebuildSubtree(child,depth,maxKeyLength);
+      return true;
+   }
+   return false;
+}
+
+bool adaptNodeLinear(NodeLinear* node,Node** nodeRef,Node** child,uint8_t key[],unsigned depth,unsigned maxKeyLength) {
+   // Account for a key inserted below bucket child (depth is the depth
+   // after the prefix, key points to the key bytes there), retrain the node
+   // or split the bucket if needed. Returns true if a subtree was rebuilt,
+   // which frees the nodes below child (and node itself on a retrain)
+   unsigned bucket=child-linearChildren(node);
+   node->size++;
+   linearOccupancy(node)[bucket]++;
+   int64_t prediction=linearPrediction(node,key);
+   if (prediction<0||prediction>=node->fanout)
+      node->misses++;
+
+   if (linearNeedsRetrain(node)) {
+      rebuildSubtree(nodeRef,depth-node->prefixLength,maxKeyLength);
+      return true;
+   }
+   return splitBucketLinear(node,child,depth,maxKeyLength);
+}
+
+static unsigned nodeCapacity(Node* node) {
+   // Children a classic node holds before it has to grow
+   switch (node->type) {
+      case NodeType4: return NODE4_SIZE;
+      case NodeType16: return 16;
+      case NodeType32: return 32;
+      case NodeType48: return NODE48_SIZE;
+      default: return 256;
+   }
+}
+
+static void insertChild(Node* node,Node** nodeRef,uint8_t keyByte,Node* child) {
+   // Link child into a classic node under keyByte
+   switch (node->type) {
+      case NodeType4: insertNode4(static_cast<Node4*>(node),nodeRef,keyByte,child); break;
+      case NodeType16: insertNode16(static_cast<Node16*>(node),nodeRef,keyByte,child); break;
+      case NodeType32: insertNode32(static_cast<Node32*>(node),nodeRef,keyByte,child); break;
+      case NodeType48: insertNode48(static_cast<Node48*>(node),nodeRef,keyByte,child); break;
+      case NodeType256: insertNode256(static_cast<Node256*>(node),nodeRef,keyByte,child); break;
+   }
+}
+
+static size_t mergeRange(Node** nodeRef,const uint64_t* keys,uint8_t* keyBytes,size_t n,unsigned depth,unsigned maxKeyLength) {
+   // Merge the sorted keys[0..n) (their bytes in keyBytes, maxKeyLength
+   // per key) into the subtree at nodeRef, which sits at depth. Recurses
+   // once per subtree the batch shares with the tree, which is bounded by
+   // the key length plus the linear nodes on a path. Returns the number of
+   // new keys.
+   Node* node=loadLazy(nodeRef);
+   if (n==0)
+      return 0;
+   if (node==NULL||isLeaf(node)) {
+      // A batch key equal to the leaf replaces it
+      uint8_t existingKey[maxKeyLength];
+      size_t equal=n;
+      if (node) {
+         // Zeroed, a loader may fill fewer than maxKeyLength bytes
+         memset(existingKey,0,maxKeyLength);
+         loadKey(getLeafValue(node),existingKey);
+         for (size_t i=0;i<n&&equal==n;i++)
+            if (memcmp(existingKey,keyBytes+i*maxKeyLength,maxKeyLength)==0)
+               equal=i;
+      }
+      if (n<=8) {
+         // Few keys, inserted one by one like the tail of insertBulk, the
+         // first straight into the slot
+         size_t first=(equal<n)?equal:0;
+         if (equal<n||!node)
+            *nodeRef=makeLeaf(keys[first]);
+         else
+            *nodeRef=joinLeaves(node,existingKey,keyBytes,depth,keys[0]);
+         for (size_t i=0;i<n;i++)
+            if (i!=first)
+               insert(*nodeRef,nodeRef,keyBytes+i*maxKeyLength,depth,keys[i],maxKeyLength);
+      } else {
+         // A new subtree, bulk loaded from a copy since insertBulk permutes
+         std::vector<uint64_t> values(keys,keys+n);
+         if (node&&equal==n)
+            values.push_back(getLeafValue(node));
+         *nodeRef=NULL;
+         insertBulk(NULL,nodeRef,values.data(),values.size(),depth,maxKeyLength);
+      }
+      return (node&&equal<n)?n-1:n;
+   }
+
+   // Handle prefix of inner node. The keys sharing it form one run, the
+   // others split the prefix one by one and the run is merged again below
+   // the new node
+   if (node->prefixLength) {
+      if (prefixMismatch(node,keyBytes,depth,maxKeyLength)!=node->prefixLength||(n>1&&prefixMismatch(node,keyBytes+(n-1)*maxKeyLength,depth,maxKeyLength)!=node->prefixLength)) {
+         size_t lo=0;
+         while (lo<n&&prefixMismatch(node,keyBytes+lo*maxKeyLength,depth,maxKeyLength)!=node->prefixLength)
+            lo++;
+         size_t hi=lo;
+         while (hi<n&&prefixMismatch(node,keyBytes+hi*maxKeyLength,depth,maxKeyLength)==node->prefixLength)
+            hi++;
+         for (size_t i=0;i<n;i++)
+            if (i<lo||i>=hi)
+               insert(*nodeRef,nodeRef,keyBytes+i*maxKeyLength,depth,keys[i],maxKeyLength);
+         return (n-(hi-lo))+mergeRange(nodeRef,keys+lo,keyBytes+lo*maxKeyLength,hi-lo,depth,maxKeyLength);
+      }
+      depth+=node->prefixLength;
+   }
+
+   size_t added=0;
+   if (node->type==NodeTypeLinear) {
+      // Runs of keys predicted into the same bucket, then one retrain or
+      // split check per touched bucket
+      NodeLinear* linear=static_cast<NodeLinear*>(node);
+      Node** children=linearChildren(linear);
+      for (size_t i=0;i<n;) {
+         int64_t prediction=linearPrediction(linear,keyBytes+i*maxKeyLength+depth);
+         unsigned bucket=linearBucket(linear,keyBytes+i*maxKeyLength+depth);
+         size_t end=i+1;
+         while (end<n&&linearBucket(linear,keyBytes+end*maxKeyLength+depth)==bucket)
+            end++;
+         bool empty=children[bucket]==NULL;
+         size_t bucketAdded=mergeRange(&children[bucket],keys+i,keyBytes+i*maxKeyLength,end-i,depth,maxKeyLength);
+         linear->count+=empty;
+         linear->size+=bucketAdded;
+         linearOccupancy(linear)[bucket]+=bucketAdded;
+         if (bucketAdded&&(prediction<0||prediction>=linear->fanout))
+            linear->misses+=bucketAdded;
+         added+=bucketAdded;
+         i=end;
+      }
+      if (linearNeedsRetrain(linear)) {
+         rebuildSubtree(nodeRef,depth-linear->prefixLength,maxKeyLength);
+         return added;
+      }
+      for (size_t i=0;i<n;) {
+         unsigned bucket=linearBucket(linear,keyBytes+i*maxKeyLength+depth);
+         while (i<n&&linearBucket(linear,keyBytes+i*maxKeyLength+depth)==bucket)
+            i++;
+         splitBucketLinear(linear,&children[bucket],depth,maxKeyLength);
+      }
+      return added;
+   }
+
+   // Grow once for all new children of a classic node, unless the batch
+   // fits anyway
+   if (node->count+n>nodeCapacity(node)) {
+      unsigned newChildren=0;
+      for (size_t i=0;i<n;i++) {
+         uint8_t keyByte=keyBytes[i*maxKeyLength+depth];
+         if ((i==0||keyBytes[(i-1)*maxKeyLength+depth]!=keyByte)&&*findChildByte(node,keyByte)==NULL)
+            newChildren++;
+      }
+      while (node->count+newChildren>nodeCapacity(node)) {
+         Node* newNode=grow(node);
+         freeNode(node);
+         *nodeRef=node=newNode;
+      }
+   }
+   for (size_t i=0;i<n;) {
+      uint8_t keyByte=keyBytes[i*maxKeyLength+depth];
+      size_t end=i+1;
+      while (end<n&&keyBytes[end*maxKeyLength+depth]==keyByte)
+         end++;
+      Node** child=findChildByte(node,keyByte);
+      if (*child) {
+         added+=mergeRange(child,keys+i,keyBytes+i*maxKeyLength,end-i,depth+1,maxKeyLength);
+      } else {
+         Node* subtree=NULL;
+         if (end-i==1) {
+            subtree=makeLeaf(keys[i]);
+            added++;
+         } else {
+            added+=mergeRange(&subtree,keys+i,keyBytes+i*maxKeyLength,end-i,depth+1,maxKeyLength);
+         }
+         insertChild(node,nodeRef,keyByte,subtree);
+      }
+      i=end;
+   }
+   return added;
+}
+
+void mergeBatch(Node** root,const uint64_t* sortedKeys,size_t n,unsigned maxKeyLength) {
+   // Upsert a sorted batch of distinct keys, descending once per subtree
+   // the batch shares with the tree; empty slots get bulk-loaded subtrees
+   // and every node grows at most once per batch
+   std::vector<uint8_t> keyBytes(n*maxKeyLength);
+   for (size_t i=0;i<n;i++)
+      loadKey(sortedKeys[i],keyBytes.data()+i*maxKeyLength);
+   mergeRange(root,sortedKeys,keyBytes.data(),n,0,maxKeyLength);
+}
+
+// Forward references
+void eraseNode4(Node4* node,Node** nodeRef,Node** leafPlace);
+void eraseNode16(Node16* node,Node** nodeRef,Node** leafPlace);
+void eraseNode32(Node32* node,Node** nodeRef,Node** leafPlace);
+void eraseNode48(Node48* node,Node** nodeRef,uint8_t keyByte);
+void eraseNode256(Node256* node,Node** nodeRef,uint8_t keyByte);
+void eraseNodeLinear(NodeLinear* node,Node** nodeRef,Node** leafPlace);
+
+bool erase(Node* node,Node** nodeRef,uint8_t key[],unsigned keyLength,unsigned depth,unsigned maxKeyLength) {
+   // Delete a leaf from a tree, returns false if the key was not found.
+   // Iterative; the key counts of the linear nodes passed are only updated
+   // once the leaf is gone
+   LinearStep steps[PATH_MAX_LINEAR];
+   unsigned stepCount=0;
+   bool erased=false;
+   for (;;) {
+      if (!node)
+         break;
+
+      if (isLeaf(node)) {
+         // Make sure we have the right leaf
+         if (leafMatches(node,key,keyLength,depth,maxKeyLength)) {
+            *nodeRef=NULL;
+            erased=true;
+         }
+         break;
+      }
+
+      // Handle prefix
+      if (node->prefixLength) {
+         if (prefixMismatch(node,key,depth,maxKeyLength)!=node->prefixLength)
+            break;
+         depth+=node->prefixLength;
+      }
+
+      Node** child=findChild(node,key+depth);
+      loadLazy(child);
+      if (isLeaf(*child)&&leafMatches(*child,key,keyLength,depth,maxKeyLength)) {
+         // Leaf found, delete it in inner node
+         switch (node->type) {
+            case NodeType4: eraseNode4(static_cast<Node4*>(node),nodeRef,child); break;
+            case NodeType16: eraseNode16(static_cast<Node16*>(node),nodeRef,child); break;
+            case NodeType32: eraseNode32(static_cast<Node32*>(node),nodeRef,child); break;
+            case NodeType48: eraseNode48(static_cast<Node48*>(node),nodeRef,key[depth]); break;
+            case NodeType256: eraseNode256(static_cast<Node256*>(node),nodeRef,key[depth]); break;
+            case NodeTypeLinear: eraseNodeLinear(static_cast<NodeLinear*>(node),nodeRef,child); break;
+         }
+         erased=true;
+         break;
+      }
+
+      // Descend, a NodeLinear does not consume the key byte
+      if (node->type==NodeTypeLinear) {
+         steps[stepCount++]={static_cast<NodeLinear*>(node),nodeRef,child,depth,0};
+         if (stepCount==PATH_MAX_LINEAR) {
+            erased=erase(*child,child,key,keyLength,depth,maxKeyLength);
+            break;
+         }
+      } else {
+         depth++;
+      }
+      node=*child;
+      nodeRef=child;
+   }
+
+   if (erased)
+      while (stepCount--) {
+         NodeLinear* n=steps[stepCount].node;
+         n->size--;
+         linearOccupancy(n)[steps[stepCount].child-linearChildren(n)]--;
+      }
+   return erased;
+}
+
+void eraseNode4(Node4* node,Node** nodeRef,Node** leafPlace) {
+   // Delete leaf from inner node
+   unsigned pos=leafPlace-node->child;
+   memmove(node->key+pos,node->key+pos+1,node->count-pos-1);
+   memmove(node->child+pos,node->child+pos+1,(node->count-pos-1)*sizeof(uintptr_t));
+   node->count--;
+
+   if (node->count==1) {
+      // Get rid of one-way node, a lazy child is built to take the prefix
+      Node* child=loadLazy(&node->child[0]);
+      if (!isLeaf(child)) {
+         // Concantenate prefixes
+         unsigned l1=node->prefixLength;
+         if (l1<maxPrefixLength) {
+            node->prefix[l1]=node->key[0];
+            l1++;
+         }
+         if (l1<maxPrefixLength) {
+            unsigned l2=min(child->prefixLength,maxPrefixLength-l1);
+            memcpy(node->prefix+l1,child->prefix,l2);
+            l1+=l2;
+         }
+         // Store concantenated prefix
+         memcpy(child->prefix,node->prefix,min(l1,maxPrefixLength));
+         child->prefixLength+=node->prefixLength+1;
+      }
+      *nodeRef=child;
+      freeNode(node);
+   }
+}
+
+void eraseNode16(Node16* node,Node** nodeRef,Node** leafPlace) {
+   // Delete leaf from inner node
+   unsigned pos=leafPlace-node->child;
+   memmove(node->key+pos,node->key+pos+1,node->count-pos-1);
+   memmove(node->child+pos,node->child+pos+1,(node->count-pos-1)*sizeof(uintptr_t));
+   node->count--;
+
+   if (node->count==NODE4_SIZE-1) {
+      // Shrink to Node4
+      Node4* newNode=allocNode<Node4>();
+      newNode->count=node->count;
+      copyPrefix(node,newNode);
+      for (unsigned i=0;i<NODE4_SIZE-1;i++)
+         newNode->key[i]=flipSign(node->key[i]);
+      memcpy(newNode->child,node->child,sizeof(uintptr_t)*NODE4_SIZE);
+      *nodeRef=newNode;
+      freeNode(node);
+   }
+}
+
+void eraseNode32(Node32* node,Node** nodeRef,Node** leafPlace) {
+   // Delete leaf from inner node
+   unsigned pos=leafPlace-node->child;
+   memmove(node->key+pos,node->key+pos+1,node->count-pos-1);
+   memmove(node->child+pos,node->child+pos+1,(node->count-pos-1)*sizeof(uintptr_t));
+   node->count--;
+
+   if (node->count==12) {
+      // Shrink to Node16, keys stay flipped
+      Node16* newNode=allocNode<Node16>();
+      newNode->count=node->count;
+      copyPrefix(node,newNode);
+      memcpy(newNode->key,node->key,node->count);
+      memcpy(newNode->child,node->child,node->count*sizeof(uintptr_t));
+      *nodeRef=newNode;
+      freeNode(node);
+   }
+}
+
+void eraseNode48(Node48* node,Node** nodeRef,uint8_t keyByte) {
+   // Delete leaf from inner node
+   node->child[node->childIndex[keyByte]]=NULL;
+   node->childIndex[keyByte]=emptyMarker;
+   node->count--;
+
+   if (node->count==24) {
+      // Shrink to Node32
+      Node32 *newNode=allocNode<Node32>();
+      *nodeRef=newNode;
+      copyPrefix(node,newNode);
+      for (unsigned b=0;b<256;b++) {
+         if (node->childIndex[b]!=emptyMarker) {
+            newNode->key[newNode->count]=flipSign(b);
+            newNode->child[newNode->count]=node->child[node->childIndex[b]];
+            newNode->count++;
+         }
+      }
+      freeNode(node);
+   }
+}
+
+void eraseNode256(Node256* node,Node** nodeRef,uint8_t keyByte) {
+   // Delete leaf from inner node
+   node->child[keyByte]=NULL;
+   node->count--;
+
+   /*
+   if (node->count==12) {
+      // Shrink to Node16
+      Node16 *newNode=allocNode<Node16>();
+      *nodeRef=newNode;
+      copyPrefix(node,newNode);
+      for (unsigned b=0;b<256;b++) {
+         if (node->child[b]) {
+            newNode->key[newNode->count]=flipSign(b);
+            newNode->child[newNode->count]=node->child[b];
+            newNode->count++;
+         }
+      }
+      freeNode(node);
+   }
+   */
+
+   if (node->count==NODE48_SIZE*3/4) {
+      // Shrink to Node48
+      Node48 *newNode=allocNode<Node48>();
+      *nodeRef=newNode;
+      copyPrefix(node,newNode);
+      for (unsigned b=0;b<256;b++) {
+         if (node->child[b]) {
+            newNode->childIndex[b]=newNode->count;
+            newNode->child[newNode->count]=node->child[b];
+            newNode->count++;
+         }
+      }
+      freeNode(node);
+   }
+   
+}
+
+void eraseNodeLinear(NodeLinear* node,Node** nodeRef,Node** leafPlace) {
+   // Delete leaf from inner node
+   node->size--;
+   linearOccupancy(node)[leafPlace-linearChildren(node)]--;
+   *leafPlace=NULL;
+   node->count--;
+
+   if (node->count==0) {
+      *nodeRef=NULL;
+      freeNode(node);
+   } else if (node->count==1) {
+      // Get rid of one-way node, the child sits at the same depth
+      unsigned pos=0;
+      while (!linearChildren(node)[pos])
+         pos++;
+      Node* child=loadLazy(&linearChildren(node)[pos]);
+      if (!isLeaf(child)) {
+         // Concantenate prefixes
+         unsigned l1=node->prefixLength;
+         if (l1<maxPrefixLength) {
+            unsigned l2=min(child->prefixLength,maxPrefixLength-l1);
+            memcpy(node->prefix+l1,child->prefix,l2);
+            l1+=l2;
+         }
+         // Store concantenated prefix
+         memcpy(child->prefix,node->prefix,min(l1,maxPrefixLength));
+         child->prefixLength+=node->prefixLength;
+      }
+      *nodeRef=child;
+      freeNode(node);
+   }
+}
+
+// Optimistic lock coupling (Leis et al., "The ART of practical
+// synchronization"). Readers take no locks: they remember the version of
+// each node they read and restart if it changed. Writers lock only the nodes
+// they modify, plus the parent when the node is replaced. Replaced nodes
+// are marked obsolete and retired; they are freed by epoch-based
+// reclamation once no operation that may still see them is running.
+// Inserts into linear nodes fill empty buckets or expand leaves but do not
+// retrain or split; erase and bulk loading stay single-threaded.
+
+static const uint32_t VERSION_OBSOLETE=1;
+static const uint32_t VERSION_LOCKED=2;
+
+static inline uint32_t readLockOrRestart(std::atomic<uint32_t>& version,bool& restart) {
+   // Wait for a writer to finish, obsolete nodes force a restart
+   uint32_t v=version.load(std::memory_order_acquire);
+   while (v&VERSION_LOCKED) {
+      _mm_pause();
+      v=version.load(std::memory_order_acquire);
+   }
+   if (v&VERSION_OBSOLETE)
+      restart=true;
+   return v;
+}
+
+static inline void checkOrRestart(std::atomic<uint32_t>& version,uint32_t v,bool& restart) {
+   // Validate everything read since readLockOrRestart returned v
+   std::atomic_thread_fence(std::memory_order_acquire);
+   if (version.load(std::memory_order_relaxed)!=v)
+      restart=true;
+}
+
+static inline void upgradeToWriteLockOrRestart(std::atomic<uint32_t>& version,uint32_t v,bool& restart) {
+   if (!version.compare_exchange_strong(v,v+VERSION_LOCKED,std::memory_order_acquire))
+      restart=true;
+}
+
+static inline void writeUnlock(std::atomic<uint32_t>& version) {
+   // Clears the lock bit and increments the version
+   version.fetch_add(VERSION_LOCKED,std::memory_order_release);
+}
+
+static inline void writeUnlockObsolete(std::atomic<uint32_t>& version) {
+   version.fetch_add(VERSION_LOCKED+VERSION_OBSOLETE,std::memory_order_release);
+}
+
+static inline Node* loadChild(Node** slot) {
+   return __atomic_load_n(slot,__ATOMIC_ACQUIRE);
+}
+
+static inline void publishChild(Node** slot,Node* child) {
+   // Link a fully initialized node (or leaf) into the tree
+   __atomic_store_n(slot,child,__ATOMIC_RELEASE);
+}
+
+static inline bool isFull(Node* node) {
+   switch (node->type) {
+      case NodeType4: return node->count==NODE4_SIZE;
+      case NodeType16: return node->count==16;
+      case NodeType32: return node->count==32;
+      case NodeType48: return node->count==NODE48_SIZE;
+   }
+   // Node256 and linear nodes have a slot for every key byte
+   return false;
+}
+
+// Epochs. Every thread owns a record with the epoch its running operation
+// pinned (0 if none) and its retired nodes, stamped with the global epoch at
+// retirement. A node is freed once every pinned epoch is newer than its
+// stamp. Records of finished threads are reused by new threads.
+static const unsigned EPOCH_RECLAIM_BATCH=64;
+
+struct EpochThread {
+   std::atomic<uint64_t> epoch{0};
+   std::atomic<bool> owned{true};
+   unsigned nesting=0;
+   std::vector<std::pair<uint64_t,Node*>> retired;
+   EpochThread* next=NULL;
+};
+
+static std::atomic<uint64_t> globalEpoch(1);
+static std::atomic<EpochThread*> epochThreads(NULL);
+
+static void reclaim(EpochThread* self) {
+   // Free the retired nodes of self no running operation can reach
+   globalEpoch.fetch_add(1);
+   uint64_t oldest=UINT64_MAX;
+   for (EpochThread* t=epochThreads.load(std::memory_order_acquire);t;t=t->next) {
+      uint64_t epoch=t->epoch.load();
+      if (epoch&&epoch<oldest)
+         oldest=epoch;
+   }
+   size_t kept=0;
+   for (size_t i=0;i<self->retired.size();i++)
+      if (self->retired[i].first<oldest)
+         freeNode(self->retired[i].second);
+      else
+         self->retired[kept++]=self->retired[i];
+   self->retired.resize(kept);
+}
+
+struct EpochSlot {
+   EpochThread* thread;
+
+   EpochSlot() : thread(NULL) {
+      for (EpochThread* t=epochThreads.load(std::memory_order_acquire);t&&!thread;t=t->next) {
+         bool owned=false;
+         if (t->owned.compare_exchange_strong(owned,true))
+            thread=t;
+      }
+      if (!thread) {
+         thread=new EpochThread();
+         thread->next=epochThreads.load();
+         while (!epochThreads.compare_exchange_weak(thread->next,thread));
+      }
+   }
+   ~EpochSlot() {
+      // Nodes still pinned by other threads stay with the record
+      reclaim(thread);
+      thread->owned.store(false,std::memory_order_release);
+   }
+};
+
+static EpochThread* epochThread() {
+   static thread_local EpochSlot slot;
+   return slot.thread;
+}
+
+EpochGuard::EpochGuard() {
+   EpochThread* self=epochThread();
+   if (self->nesting++==0)
+      self->epoch.store(globalEpoch.load());
+}
+
+EpochGuard::~EpochGuard() {
+   EpochThread* self=epochThread();
+   if (--self->nesting==0)
+      self->epoch.store(0,std::memory_order_release);
+}
+
+void retireNode(Node* node) {
+   // Free node once no concurrent operation can reach it any more
+   EpochThread* self=epochThread();
+   self->retired.push_back(std::make_pair(globalEpoch.load(),node));
+   if (self->retired.size()>=EPOCH_RECLAIM_BATCH)
+      reclaim(self);
+}
+
+void synchronizeEpochs() {
+   // Wait until every operation that was running at the call has finished;
+   // the caller must not hold an EpochGuard itself
+   assert(epochThread()->nesting==0);
+   uint64_t target=globalEpoch.fetch_add(1)+1;
+   for (EpochThread* t=epochThreads.load(std::memory_order_acquire);t;t=t->next) {
+      uint64_t epoch=t->epoch.load();
+      while (epoch&&epoch<target) {
+         std::this_thread::yield();
+         epoch=t->epoch.load();
+      }
+   }
+}
+
+static Node* replicateTop(Node* node,unsigned levels) {
+   // Copy of the top levels of the subtree in the current arena, the
+   // copies on the last level point to the original children. Lazy nodes
+   // are shared, not copied
+   if (node==NULL||isLeaf(node)||levels==0||node->type==NodeTypeLazy)
+      return node;
+   Node* copy=static_cast<Node*>(arenaAlloc(nodePool(node)));
+   memcpy(static_cast<void*>(copy),node,nodeSize(node));
+   if (levels==1)
+      return copy;
+   switch (copy->type) {
+      case NodeType4: {
+         Node4* n=static_cast<Node4*>(copy);
+         for (unsigned i=0;i<n->count;i++)
+            n->child[i]=replicateTop(n->child[i],levels-1);
+         break;
+      }
+      case NodeType16: {
+         Node16* n=static_cast<Node16*>(copy);
+         for (unsigned i=0;i<n->count;i++)
+            n->child[i]=replicateTop(n->child[i],levels-1);
+         break;
+      }
+      case NodeType32: {
+         Node32* n=static_cast<Node32*>(copy);
+         for (unsigned i=0;i<n->count;i++)
+            n->child[i]=replicateTop(n->child[i],levels-1);
+         break;
+      }
+      case NodeType48: {
+         Node48* n=static_cast<Node48*>(copy);
+         for (unsigned i=0;i<NODE48_SIZE;i++)
+            n->child[i]=replicateTop(n->child[i],levels-1);
+         break;
+      }
+      case NodeType256: {
+         Node256* n=static_cast<Node256*>(copy);
+         for (unsigned i=0;i<256;i++)
+            n->child[i]=replicateTop(n->child[i],levels-1);
+         break;
+      }
+      case NodeTypeLinear: {
+         NodeLinear* n=static_cast<NodeLinear*>(copy);
+         for (unsigned i=0;i<n->fanout;i++)
+            linearChildren(n)[i]=replicateTop(linearChildren(n)[i],levels-1);
+         break;
+      }
+   }
+   return copy;
+}
+
+SnapshotTree::~SnapshotTree() {
+   // No readers may be left
+   delete arena;
+   for (Arena* replicaArena : replicaArenas)
+      delete replicaArena;
+   delete[] replicas.load();
+}
+
+void publishSnapshot(SnapshotTree& tree,uint64_t* keys,size_t n,unsigned threads,unsigned maxKeyLength) {
+   // Bulk load keys (partitioned in place) into a new arena, copy its top
+   // levels to every NUMA node if the tree asks for replicas, swap the root
+   // and the replicas, then drop the previous snapshot once its readers
+   // drained
+   std::lock_guard<std::mutex> lock(tree.rebuild);
+   Arena* arena=new Arena(tree.replicaLevels?ARENA_NUMA_INTERLEAVE:ARENA_NUMA_ANY);
+   Arena* previous=setArena(arena);
+   Node* root=NULL;
+   if (n)
+      insertBulkParallel(&root,keys,n,threads,maxKeyLength);
+   Node** replicas=NULL;
+   std::vector<Arena*> replicaArenas;
+   if (tree.replicaLevels) {
+      unsigned nodes=numaNodeCount();
+      replicas=new Node*[nodes];
+      for (unsigned i=0;i<nodes;i++) {
+         replicaArenas.push_back(new Arena(i));
+         setArena(replicaArenas.back());
+         replicas[i]=replicateTop(root,tree.replicaLevels);
+      }
+   }
+   setArena(previous);
+
+   // Readers take either the replicas or the root, each swap alone
+   // publishes a complete tree
+   tree.root.store(root);
+   Node** oldReplicas=tree.replicas.exchange(replicas);
+   Arena* oldArena=tree.arena;
+   tree.arena=arena;
+   tree.replicaArenas.swap(replicaArenas);
+   synchronizeEpochs();
+   delete oldArena;
+   for (Arena* replicaArena : replicaArenas)
+      delete replicaArena;
+   delete[] oldReplicas;
+}
+
+Node* lookupOLC(ConcurrentTree& tree,uint8_t key[],unsigned keyLength,unsigned maxKeyLength) {
+   // Find the leaf with a matching key while other threads insert
+   EpochGuard guard;
+restart:
+   bool restart=false;
+   uint32_t version=readLockOrRestart(tree.version,restart);
+   Node* node=loadChild(&tree.root);
+   checkOrRestart(tree.version,version,restart);
+   unsigned depth=0;
+   bool skippedPrefix=false;
+
+   while (node&&!isLeaf(node)) {
+      version=readLockOrRestart(node->version,restart);
+      if (restart)
+         goto restart;
+      if (node->prefixLength) {
+         if (matchPrefix(node,key,depth,keyLength)<min(node->prefixLength,maxPrefixLength)) {
+            checkOrRestart(node->version,version,restart);
+            if (restart)
+               goto restart;
+            return NULL;
+         }
+         if (node->prefixLength>maxPrefixLength)
+            skippedPrefix=true;
+         depth+=node->prefixLength;
+      }
+      if (depth>=keyLength) {
+         // Only reachable through a torn read
+         checkOrRestart(node->version,version,restart);
+         if (restart)
+            goto restart;
+         return NULL;
+      }
+      unsigned type=node->type;
+      Node* child=loadChild(findChild(node,key+depth));
+      checkOrRestart(node->version,version,restart);
+      if (restart)
+         goto restart;
+      if (type!=NodeTypeLinear)
+         depth++;
+      node=child;
+   }
+
+   if (node&&(skippedPrefix||depth!=keyLength)&&!leafMatches(node,key,keyLength,skippedPrefix?0:depth,maxKeyLength))
+      return NULL;
+   return node;
+}
+
+// Linear nodes passed by one insert, their key counts are raised once it
+// succeeded; deeper ones are not counted
+static const unsigned OLC_LINEAR_PATH=16;
+
+void insertOLC(ConcurrentTree& tree,uint8_t key[],uintptr_t value,unsigned maxKeyLength) {
+   // Insert the leaf value while other threads read and insert; an existing
+   // leaf with the same key is kept
+   EpochGuard guard;
+restart:
+   bool restart=false;
+   NodeLinear* linearPath[OLC_LINEAR_PATH];
+   unsigned linearBuckets[OLC_LINEAR_PATH];
+   unsigned linearCount=0;
+
+   // The lock guarding the slot of node (the tree or the parent) and the
+   // version it was read at
+   std::atomic<uint32_t>* parentLock=&tree.version;
+   uint32_t parentVersion=readLockOrRestart(tree.version,restart);
+   Node** nodeRef=&tree.root;
+   Node* node=loadChild(nodeRef);
+   unsigned depth=0;
+
+   if (node==NULL||isLeaf(node)) {
+      // Empty tree or a single leaf, replaced under the tree lock
+      upgradeToWriteLockOrRestart(tree.version,parentVersion,restart);
+      if (restart)
+         goto restart;
+      if (node==NULL)
+         publishChild(nodeRef,makeLeaf(value));
+      else if (!leafMatches(node,key,maxKeyLength,0,maxKeyLength))
+         publishChild(nodeRef,expandLeaf(node,key,0,value,maxKeyLength));
+      writeUnlock(tree.version);
+      return;
+   }
+
+   while (true) {
+      uint32_t version=readLockOrRestart(node->version,restart);
+      if (restart)
+         goto restart;
+
+      if (node->prefixLength) {
+         unsigned mismatchPos=prefixMismatch(node,key,depth,maxKeyLength);
+         checkOrRestart(node->version,version,restart);
+         if (restart)
+            goto restart;
+         if (mismatchPos!=node->prefixLength) {
+            // Prefix differs: a new Node4 replaces node in its parent, and
+            // node keeps the rest of its prefix
+            upgradeToWriteLockOrRestart(*parentLock,parentVersion,restart);
+            if (restart)
+               goto restart;
+            upgradeToWriteLockOrRestart(node->version,version,restart);
+            if (restart) {
+               writeUnlock(*parentLock);
+               goto restart;
+            }
+            publishChild(nodeRef,splitPrefix(node,key,depth,mismatchPos,value,maxKeyLength));
+            writeUnlock(node->version);
+            writeUnlock(*parentLock);
+            break;
+         }
+         depth+=node->prefixLength;
+      }
+      if (depth>=maxKeyLength) {
+         // Only reachable through a torn read
+         checkOrRestart(node->version,version,restart);
+         goto restart;
+      }
+
+      uint8_t keyByte=key[depth];
+      Node** child=findChild(node,key+depth);
+      Node* next=loadChild(child);
+      checkOrRestart(node->version,version,restart);
+      if (restart)
+         goto restart;
+
+      if (next==NULL) {
+         if (isFull(node)) {
+            // Grow: the larger copy replaces node in its parent
+            upgradeToWriteLockOrRestart(*parentLock,parentVersion,restart);
+            if (restart)
+               goto restart;
+            upgradeToWriteLockOrRestart(node->version,version,restart);
+            if (restart) {
+               writeUnlock(*parentLock);
+               goto restart;
+            }
+            Node* newNode=grow(node);
+            Node* ref=newNode;
+            switch (newNode->type) {
+               case NodeType16: insertNode16(static_cast<Node16*>(newNode),&ref,keyByte,makeLeaf(value)); break;
+               case NodeType32: insertNode32(static_cast<Node32*>(newNode),&ref,keyByte,makeLeaf(value)); break;
+               case NodeType48: insertNode48(static_cast<Node48*>(newNode),&ref,keyByte,makeLeaf(value)); break;
+               case NodeType256: insertNode256(static_cast<Node256*>(newNode),&ref,keyByte,makeLeaf(value)); break;
+            }
+            publishChild(nodeRef,newNode);
+            writeUnlockObsolete(node->version);
+            retireNode(node);
+            writeUnlock(*parentLock);
+         } else {
+            // Room left, only node changes
+            upgradeToWriteLockOrRestart(node->version,version,restart);
+            if (restart)
+               goto restart;
+            switch (node->type) {
+               case NodeType4: insertNode4(static_cast<Node4*>(node),nodeRef,keyByte,makeLeaf(value)); break;
+               case NodeType16: insertNode16(static_cast<Node16*>(node),nodeRef,keyByte,makeLeaf(value)); break;
+               case NodeType32: insertNode32(static_cast<Node32*>(node),nodeRef,keyByte,makeLeaf(value)); break;
+               case NodeType48: insertNode48(static_cast<Node48*>(node),nodeRef,keyByte,makeLeaf(value)); break;
+               case NodeType256: insertNode256(static_cast<Node256*>(node),nodeRef,keyByte,makeLeaf(value)); break;
+               case NodeTypeLinear: {
+                  NodeLinear* n=static_cast<NodeLinear*>(node);
+                  n->count++;
+                  n->size++;
+                  linearOccupancy(n)[child-linearChildren(n)]++;
+                  publishChild(child,makeLeaf(value));
+                  break;
+               }
+            }
+            writeUnlock(node->version);
+         }
+         break;
+      }
+
+      // The parent is not needed any more once node is known to be current
+      checkOrRestart(*parentLock,parentVersion,restart);
+      if (restart)
+         goto restart;
+
+      unsigned childDepth=depth+(node->type!=NodeTypeLinear);
+      if (isLeaf(next)) {
+         if (leafMatches(next,key,maxKeyLength,childDepth,maxKeyLength))
+            return;
+         // Replace the leaf by a Node4 holding both leaves
+         upgradeToWriteLockOrRestart(node->version,version,restart);
+         if (restart)
+            goto restart;
+         publishChild(child,expandLeaf(next,key,childDepth,value,maxKeyLength));
+         if (node->type==NodeTypeLinear) {
+            NodeLinear* n=static_cast<NodeLinear*>(node);
+            n->size++;
+            linearOccupancy(n)[child-linearChildren(n)]++;
+         }
+         writeUnlock(node->version);
+         break;
+      }
+
+      if (node->type==NodeTypeLinear&&linearCount<OLC_LINEAR_PATH) {
+         linearPath[linearCount]=static_cast<NodeLinear*>(node);
+         linearBuckets[linearCount]=child-linearChildren(linearPath[linearCount]);
+         linearCount++;
+      }
+      parentLock=&node->version;
+      parentVersion=version;
+      nodeRef=child;
+      node=next;
+      depth=childDepth;
+   }
+
+   // Key counts of the linear nodes above the modified node, they only
+   // steer single-threaded retraining and are not validated
+   for (unsigned i=0;i<linearCount;i++) {
+      __atomic_fetch_add(&linearPath[i]->size,1,__ATOMIC_RELAXED);
+      __atomic_fetch_add(&linearOccupancy(linearPath[i])[linearBuckets[i]],1,__ATOMIC_RELAXED);
+   }
+}
+
+// Serialized trees
+
+static const char IMAGE_MAGIC[8]={'A','R','T','I','M','G','0','4'};
+// The first node starts at this offset, which keeps 0 free for "no child"
+static const uint64_t IMAGE_HEADER_SIZE=64;
+static const size_t nodeAlignments[NodeTypeCount]={alignof(Node4),alignof(Node16),alignof(Node48),alignof(Node256),alignof(NodeLinear),alignof(NodeLazy),alignof(Node32)};
+
+struct ImageHeader {
+   char magic[8];
+   // layout the image was written with
+   uint32_t maxPrefixLength;
+   uint32_t nodeSizes[NodeTypeCount];
+   // file size and child reference of the root
+   uint64_t size;
+   uint64_t root;
+   // imageLayout of the writer
+   uint64_t layout;
+};
+static_assert(sizeof(ImageHeader)<=IMAGE_HEADER_SIZE,"image header too large");
+
+static uint64_t layoutFingerprint() {
+   // FNV-1a hash of the offsets of the node fields an image stores, taken
+   // from nodes built in a scratch slot
+   size_t slotSize=std::max(sizeof(Node256),linearNodeSize(LINEAR_MIN_FANOUT));
+   uint8_t* slot=static_cast<uint8_t*>(aligned_alloc(64,(slotSize+63)&~static_cast<size_t>(63)));
+   uint64_t hash=14695981039346656037ull;
+   auto add=[&](const void* field) {
+      hash=(hash^static_cast<uint64_t>(static_cast<const uint8_t*>(field)-slot))*1099511628211ull;
+   };
+   Node4* n4=new (slot) Node4();
+   add(&n4->prefixLength);add(&n4->count);add(&n4->type);add(&n4->fallback);add(n4->prefix);
+   add(n4->key);add(n4->child);
+   Node16* n16=new (slot) Node16();
+   add(n16->key);add(n16->child);
+   Node32* n32=new (slot) Node32();
+   add(n32->key);add(n32->child);
+   Node48* n48=new (slot) Node48();
+   add(n48->childIndex);add(n48->child);
+   Node256* n256=new (slot) Node256();
+   add(n256->child);
+   NodeLinear* linear=new (slot) NodeLinear(LINEAR_MIN_FANOUT);
+   add(&linear->intercept);add(&linear->slope);add(&linear->shift);add(&linear->keyBytes);add(&linear->fanout);
+   add(linearChildren(linear));
+   free(slot);
+   return hash;
+}
+
+static uint64_t imageLayout() {
+   // Node layout an image is written with, checked by mapTree so a changed
+   // field order is caught even where the node sizes stay the same
+   static const uint64_t layout=layoutFingerprint();
+   return layout;
+}
+
+static inline uint64_t alignOffset(uint64_t offset,size_t alignment) {
+   return (offset+alignment-1)&~static_cast<uint64_t>(alignment-1);
+}
+
+static Node* imageChild(Node* child,std::vector<Node*>& queue,uint64_t& end) {
+   // Reference to child in the image; inner nodes are queued and placed
+   // at the end of the image in queue order
+   if (child==NULL||isLeaf(child))
+      return child;
+   uint64_t offset=alignOffset(end,nodeAlignments[child->type]);
+   end=offset+nodeSize(child);
+   queue.push_back(child);
+   return reinterpret_cast<Node*>(offset);
+}
+
+static void imageChildren(Node* node,std::vector<Node*>& queue,uint64_t& end) {
+   // Replace the child pointers of a node copy by image references, unused
+   // slots are cleared
+   switch (node->type) {
+      case NodeType4: {
+         Node4* n=static_cast<Node4*>(node);
+         for (unsigned i=0;i<NODE4_SIZE;i++)
+            n->child[i]=(i<n->count)?imageChild(n->child[i],queue,end):NULL;
+         break;
+      }
+      case NodeType16: {
+         Node16* n=static_cast<Node16*>(node);
+         for (unsigned i=0;i<16;i++)
+            n->child[i]=(i<n->count)?imageChild(n->child[i],queue,end):NULL;
+         break;
+      }
+      case NodeType32: {
+         Node32* n=static_cast<Node32*>(node);
+         for (unsigned i=0;i<32;i++)
+            n->child[i]=(i<n->count)?imageChild(n->child[i],queue,end):NULL;
+         break;
+      }
+      case NodeType48: {
+         Node48* n=static_cast<Node48*>(node);
+         Node* child[NODE48_SIZE]={};
+         for (unsigned i=0;i<256;i++)
+            if (n->childIndex[i]!=emptyMarker)
+               child[n->childIndex[i]]=imageChild(n->child[n->childIndex[i]],queue,end);
+         memcpy(n->child,child,sizeof(child));
+         break;
+      }
+      case NodeType256: {
+         Node256* n=static_cast<Node256*>(node);
+         for (unsigned i=0;i<256;i++)
+            n->child[i]=imageChild(n->child[i],queue,end);
+         break;
+      }
+      case NodeTypeLinear: {
+         NodeLinear* n=static_cast<NodeLinear*>(node);
+         for (unsigned i=0;i<n->fanout;i++)
+            linearChildren(n)[i]=imageChild(linearChildren(n)[i],queue,end);
+         break;
       }
-      copyPrefix(node,newNode);
-      newNode->count=node->count;
-      delete node;
-      return insertNode256(newNode,nodeRef,keyByte,child);
-      */
    }
 }
 
-void insertNode48(Node48* node,Node** nodeRef,uint8_t keyByte,Node* child) {
-   // Insert leaf into inner node
-   if (node->count<NODE48_SIZE) {
-      // Insert element
-      unsigned pos=node->count;
-      if (node->child[pos])
-         for (pos=0;node->child[pos]!=NULL;pos++);
-      node->child[pos]=child;
-      node->childIndex[keyByte]=pos;
-      node->count++;
-   } else {
-      // Grow to Node256
-      Node256* newNode=new Node256();
-      for (unsigned i=0;i<256;i++)
-         if (node->childIndex[i]!=emptyMarker)
-            newNode->child[i]=node->child[node->childIndex[i]];
-      newNode->count=node->count;
-      copyPrefix(node,newNode);
-      *nodeRef=newNode;
-      delete node;
-      return insertNode256(newNode,nodeRef,keyByte,child);
+bool serializeTree(Node* root,const char* path) {
+   // Write the image of the tree to path, false on I/O errors, pending
+   // lazy subtrees or record leaves
+   if (getKeyLoader()==loadKeyRecord)
+      return false; // the leaves are addresses of records in memory
+   FILE* out=fopen(path,"wb");
+   if (!out)
+      return false;
+   ImageHeader header;
+   memset(&header,0,sizeof(header));
+   memcpy(header.magic,IMAGE_MAGIC,sizeof(IMAGE_MAGIC));
+   header.maxPrefixLength=maxPrefixLength;
+   for (int8_t type=0;type<NodeTypeCount;type++)
+      header.nodeSizes[type]=nodeSizes[type];
+   header.layout=imageLayout();
+
+   // Breadth-first, so the top levels share the first pages
+   std::vector<Node*> queue;
+   uint64_t end=IMAGE_HEADER_SIZE;
+   header.root=reinterpret_cast<uint64_t>(imageChild(root,queue,end));
+
+   static const uint8_t zeros[IMAGE_HEADER_SIZE]={};
+   bool ok=fwrite(&header,sizeof(header),1,out)==1;
+   if (sizeof(header)<IMAGE_HEADER_SIZE)
+      ok=ok&&fwrite(zeros,IMAGE_HEADER_SIZE-sizeof(header),1,out)==1;
+   uint64_t written=IMAGE_HEADER_SIZE;
+   // Large enough for the widest linear node
+   uint8_t* copy=static_cast<uint8_t*>(aligned_alloc(64,linearNodeSize(LINEAR_MAX_FANOUT)));
+   for (size_t i=0;i<queue.size()&&ok;i++) {
+      Node* node=queue[i];
+      if (node->type==NodeTypeLazy) {
+         ok=false;
+         break;
+      }
+      uint64_t offset=alignOffset(written,nodeAlignments[node->type]);
+      if (offset>written)
+         ok=fwrite(zeros,offset-written,1,out)==1;
+      memcpy(copy,node,nodeSize(node));
+      Node* image=reinterpret_cast<Node*>(copy);
+      image->version.store(0,std::memory_order_relaxed);
+      imageChildren(image,queue,end);
+      ok=ok&&fwrite(copy,nodeSize(node),1,out)==1;
+      written=offset+nodeSize(node);
    }
+   free(copy);
+   assert(!ok||written==end);
+
+   header.size=end;
+   ok=ok&&fseek(out,0,SEEK_SET)==0&&fwrite(&header,sizeof(header),1,out)==1;
+   return (fclose(out)==0)&&ok;
 }
 
-void insertNode256(Node256* node,Node** nodeRef,uint8_t keyByte,Node* child) {
-   // Insert leaf into inner node
-   node->count++;
-   node->child[keyByte]=child;
+static bool validImageNode(const uint8_t* base,size_t size,uint64_t offset) {
+   // The node at offset lies inside the image, aligned for its type, which
+   // is one an image can hold, and the fields lookups index with are in
+   // range
+   if (offset<IMAGE_HEADER_SIZE||offset%8||size<sizeof(Node)||offset>size-sizeof(Node))
+      return false;
+   Node* node=reinterpret_cast<Node*>(const_cast<uint8_t*>(base)+offset);
+   int8_t type=node->type;
+   if (type<0||type>=NodeTypeCount||type==NodeTypeLazy||offset%nodeAlignments[type]||nodeSizes[type]>size-offset)
+      return false;
+   if (type==NodeTypeLinear) {
+      const NodeLinear* linear=static_cast<const NodeLinear*>(node);
+      unsigned fanout=linear->fanout;
+      return fanout>=LINEAR_MIN_FANOUT&&fanout<=LINEAR_MAX_FANOUT&&(fanout&(fanout-1))==0&&
+         linear->keyBytes>=1&&linear->keyBytes<=4&&linear->shift<64&&
+         linearNodeSize(fanout)<=size-offset;
+   }
+   return node->count<=nodeCapacity(node);
 }
 
-// Forward references
-void eraseNode4(Node4* node,Node** nodeRef,Node** leafPlace);
-void eraseNode16(Node16* node,Node** nodeRef,Node** leafPlace);
-void eraseNode48(Node48* node,Node** nodeRef,uint8_t keyByte);
-void eraseNode256(Node256* node,Node** nodeRef,uint8_t keyByte);
+static inline Node* mappedChild(const MappedTree& tree,uint64_t parent,Node* ref) {
+   // Resolve a child reference of an image; NULL unless it is a leaf or a
+   // valid node placed after its parent (at offset parent, 0 for the root),
+   // which also rules out cycles
+   uint64_t offset=reinterpret_cast<uintptr_t>(ref);
+   if (offset==0||(offset&1))
+      return ref;
+   if (offset<=parent||!validImageNode(tree.base,tree.size,offset))
+      return NULL;
+   return reinterpret_cast<Node*>(const_cast<uint8_t*>(tree.base)+offset);
+}
 
-void erase(Node* node,Node** nodeRef,uint8_t key[],unsigned keyLength,unsigned depth,unsigned maxKeyLength) {
-   // Delete a leaf from a tree
+bool mapTree(const char* path,MappedTree& tree) {
+   // Map the image at path, false if it cannot be read, was written with a
+   // different layout or its header does not match the file
+   int fd=open(path,O_RDONLY);
+   if (fd<0)
+      return false;
+   struct stat st;
+   if (fstat(fd,&st)!=0||static_cast<uint64_t>(st.st_size)<IMAGE_HEADER_SIZE) {
+      close(fd);
+      return false;
+   }
+   void* base=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+   close(fd);
+   if (base==MAP_FAILED)
+      return false;
+
+   const ImageHeader* header=static_cast<const ImageHeader*>(base);
+   bool valid=memcmp(header->magic,IMAGE_MAGIC,sizeof(IMAGE_MAGIC))==0&&
+      header->maxPrefixLength==maxPrefixLength&&
+      header->layout==imageLayout()&&
+      header->size==static_cast<uint64_t>(st.st_size);
+   for (int8_t type=0;type<NodeTypeCount;type++)
+      valid=valid&&header->nodeSizes[type]==nodeSizes[type];
+   if (!valid) {
+      munmap(base,st.st_size);
+      return false;
+   }
+   tree.base=static_cast<const uint8_t*>(base);
+   tree.size=st.st_size;
+   tree.root=mappedChild(tree,0,reinterpret_cast<Node*>(header->root));
+   if (header->root&&!tree.root) {
+      unmapTree(tree);
+      return false;
+   }
+   return true;
+}
 
-   if (!node)
-      return;
+void unmapTree(MappedTree& tree) {
+   if (tree.base)
+      munmap(const_cast<uint8_t*>(tree.base),tree.size);
+   tree=MappedTree();
+}
 
-   if (isLeaf(node)) {
-      // Make sure we have the right leaf
-      if (leafMatches(node,key,keyLength,depth,maxKeyLength))
-         *nodeRef=NULL;
-      return;
-   }
+Node* lookupMapped(const MappedTree& tree,uint8_t key[],unsigned keyLength,unsigned maxKeyLength) {
+   // The optimistic lookup on an image, child references are resolved
+   // against its base and checked like the root, so a corrupt image ends
+   // the search instead of leading outside the mapping
+   Node* node=tree.root;
+   unsigned depth=0;
+   bool skippedPrefix=false;
 
-   // Handle prefix
-   if (node->prefixLength) {
-      if (prefixMismatch(node,key,depth,maxKeyLength)!=node->prefixLength)
-         return;
-      depth+=node->prefixLength;
-   }
+   while (node!=NULL) {
+      if (isLeaf(node)) {
+         if (!skippedPrefix&&depth==keyLength)
+            return node;
+         uint8_t leafKey[maxKeyLength];
+         loadKey(getLeafValue(node),leafKey);
+         for (unsigned i=(skippedPrefix?0:depth);i<keyLength;i++)
+            if (leafKey[i]!=key[i])
+               return NULL;
+         return node;
+      }
 
-   Node** child=findChild(node,key[depth]);
-   if (isLeaf(*child)&&leafMatches(*child,key,keyLength,depth,maxKeyLength)) {
-      // Leaf found, delete it in inner node
-      switch (node->type) {
-         case NodeType4: eraseNode4(static_cast<Node4*>(node),nodeRef,child); break;
-         case NodeType16: eraseNode16(static_cast<Node16*>(node),nodeRef,child); break;
-         case NodeType48: eraseNode48(static_cast<Node48*>(node),nodeRef,key[depth]); break;
-         case NodeType256: eraseNode256(static_cast<Node256*>(node),nodeRef,key[depth]); break;
+      if (node->prefixLength) {
+         if (matchPrefix(node,key,depth,keyLength)<std::min(node->prefixLength,maxPrefixLength))
+            return NULL;
+         if (node->prefixLength>maxPrefixLength)
+            skippedPrefix=true;
+         depth+=node->prefixLength;
       }
-   } else {
-      //Recurse
-      erase(*child,child,key,keyLength,depth+1,maxKeyLength);
+
+      if (depth>=maxKeyLength)
+         return NULL;
+      unsigned type=node->type;
+      COUNT_VISIT(type);
+      Node** slot=findChild(node,key+depth);
+      // a corrupt Node48 index can point past the node
+      if (slot!=&nullNode&&reinterpret_cast<uint8_t*>(slot)>=reinterpret_cast<uint8_t*>(node)+nodeSize(node))
+         return NULL;
+      node=mappedChild(tree,reinterpret_cast<uint8_t*>(node)-tree.base,*slot);
+      if (type!=NodeTypeLinear)
+         depth++;
    }
+
+   return NULL;
 }
 
-void eraseNode4(Node4* node,Node** nodeRef,Node** leafPlace) {
-   // Delete leaf from inner node
-   unsigned pos=leafPlace-node->child;
-   memmove(node->key+pos,node->key+pos+1,node->count-pos-1);
-   memmove(node->child+pos,node->child+pos+1,(node->count-pos-1)*sizeof(uintptr_t));
-   node->count--;
+#ifdef ART_ICU
+unsigned collationKey(const UCollator* collator,const UChar* text,int32_t length,uint8_t key[],unsigned maxKeyLength) {
+   // ICU sort key of the UTF-16 text (length -1 if 0-terminated). Sort keys
+   // compare bytewise in collation order, end with a 0 byte and hold no
+   // other 0 bytes, so they are valid variable-length keys. Returns the key
+   // length including the terminator, 0 if it does not fit into maxKeyLength.
+   int32_t needed=ucol_getSortKey(collator,text,length,key,maxKeyLength);
+   if (needed<=0||static_cast<unsigned>(needed)>maxKeyLength)
+      return 0;
+   return needed;
+}
 
-   if (node->count==1) {
-      // Get rid of one-way node
-      Node* child=node->child[0];
-      if (!isLeaf(child)) {
-         // Concantenate prefixes
-         unsigned l1=node->prefixLength;
-         if (l1<maxPrefixLength) {
-            node->prefix[l1]=node->key[0];
-            l1++;
-         }
-         if (l1<maxPrefixLength) {
-            unsigned l2=min(child->prefixLength,maxPrefixLength-l1);
-            memcpy(node->prefix+l1,child->prefix,l2);
-            l1+=l2;
-         }
-         // Store concantenated prefix
-         memcpy(child->prefix,node->prefix,min(l1,maxPrefixLength));
-         child->prefixLength+=node->prefixLength+1;
+unsigned collationKeyUTF8(const UCollator* collator,const char* text,int32_t length,uint8_t key[],unsigned maxKeyLength) {
+   // Same for UTF-8 text, converted to UTF-16 first
+   UErrorCode status=U_ZERO_ERROR;
+   int32_t units=0;
+   u_strFromUTF8(NULL,0,&units,text,length,&status);
+   if (status!=U_BUFFER_OVERFLOW_ERROR&&U_FAILURE(status))
+      return 0;
+   std::vector<UChar> buffer(units+1);
+   status=U_ZERO_ERROR;
+   u_strFromUTF8(buffer.data(),buffer.size(),&units,text,length,&status);
+   if (U_FAILURE(status))
+      return 0;
+   return collationKey(collator,buffer.data(),units,key,maxKeyLength);
+}
+#endif
+
+static double fitError(const NodeLinear* node, long double n, long double s_x, long double s_y, long double s_x2, long double s_xy, long double s_y2) {
+   // Root mean square distance in buckets between the target buckets y and
+   // the stored (fixed-point, clamped) model over x, from the sums of the fit
+   long double a = ldexp(node->slope, -node->shift), b = ldexp(static_cast<double>(node->intercept), -node->shift);
+   long double sse = s_y2 - 2*a*s_xy - 2*b*s_y + a*a*s_x2 + 2*a*b*s_x + n*b*b;
+   return sqrt(std::max(sse, 0.0L)/n);
+}
+
+void learn(NodeLinear* node, const uint64_t counts[256]) {
+   // Least-squares fit of the bucket of each key's rank on its key byte,
+   // straight from the histogram of the byte: the keys of one byte hold
+   // consecutive ranks, so their bucket sums are added a bucket at a time,
+   // in O(256+fanout) steps for any number of keys. The sums are 64-bit,
+   // the normal equations are solved in long double
+   uint64_t n = 0;
+   for(unsigned x=0; x<256; x++)
+      n += counts[x];
+   uint64_t bucket_size = (n+node->fanout-1)/node->fanout;
+   uint64_t s_x=0, s_y=0, s_xy=0, s_x2=0, s_y2=0, rank=0;
+   for(uint64_t x=0; x<256; x++) {
+      s_x += counts[x]*x;
+      s_x2 += counts[x]*x*x;
+      for(uint64_t left=counts[x]; left>0; ) {
+         uint64_t y = rank/bucket_size, run = std::min(left, (y+1)*bucket_size-rank);
+         s_y += run*y;
+         s_y2 += run*y*y;
+         s_xy += run*x*y;
+         rank += run;
+         left -= run;
       }
-      *nodeRef=child;
-      delete node;
    }
+
+   // A single byte value leaves the slope undefined, all keys go to the
+   // mean bucket
+   long double det = static_cast<long double>(n)*s_x2 - static_cast<long double>(s_x)*s_x;
+   double a = 0, b = static_cast<double>(s_y)/n;
+   if(det > 0) {
+      a = (static_cast<long double>(n)*s_xy - static_cast<long double>(s_x)*s_y)/det;
+      b = (static_cast<long double>(s_y)*s_x2 - static_cast<long double>(s_x)*s_xy)/det;
+   }
+   setLinearModel(node, a, b);
+   node->fitError = fitError(node, n, s_x, s_y, s_x2, s_xy, s_y2);
 }
 
-void eraseNode16(Node16* node,Node** nodeRef,Node** leafPlace) {
-   // Delete leaf from inner node
-   unsigned pos=leafPlace-node->child;
-   memmove(node->key+pos,node->key+pos+1,node->count-pos-1);
-   memmove(node->child+pos,node->child+pos+1,(node->count-pos-1)*sizeof(uintptr_t));
-   node->count--;
+// Nodes over more keys than this train on the byte histogram of a strided
+// sample about this size
+static const int LINEAR_TRAIN_SAMPLE_KEYS = 1<<16;
+
+void learn2(NodeLinear* node, uint64_t* dataset, int n, unsigned depth, unsigned maxKeyLength) {
+   // One-byte model for dataset[0..n) on the key byte at depth; every
+   // sampled key stands for stride keys of the histogram
+   uint64_t counts[256] = {0};
+   int stride = n > LINEAR_TRAIN_SAMPLE_KEYS ? n/LINEAR_TRAIN_SAMPLE_KEYS : 1;
+   for(int i=0; i<n; i+=stride) {
+      uint8_t key[maxKeyLength]; loadKey(dataset[i], key);
+      counts[key[depth]] += stride;
+   }
+   learn(node, counts);
+}
 
-   if (node->count==NODE4_SIZE-1) {
-      // Shrink to Node4
-      Node4* newNode=new Node4();
-      newNode->count=node->count;
-      copyPrefix(node,newNode);
-      for (unsigned i=0;i<NODE4_SIZE-1;i++)
-         newNode->key[i]=flipSign(node->key[i]);
-      memcpy(newNode->child,node->child,sizeof(uintptr_t)*NODE4_SIZE);
-      *nodeRef=newNode;
-      delete node;
+void setLinearModel(NodeLinear* node, double a, double b) {
+   // Store the model in fixed point. The slope is kept non-negative (bucket
+   // order must follow key order). One-byte models use LINEAR_MODEL_SHIFT
+   // and bounds that keep slope*255+intercept within 32 bits (predictBatch
+   // relies on it); wider models take the largest shift for which the slope
+   // fits 31 bits and slope*x+intercept stays below 2^62
+   if(!(a >= 0.0)) a = 0.0;
+   if(node->keyBytes == 1) {
+      if(a > 64.0) a = 64.0;
+      if(!(b >= -16384.0)) b = -16384.0;
+      if(b > 16384.0) b = 16384.0;
+      node->shift = LINEAR_MODEL_SHIFT;
+   } else {
+      const double xmax = ldexp(1.0, 8*node->keyBytes)-1;
+      if(a > node->fanout) a = node->fanout;
+      if(!(b >= -ldexp(1.0, 45))) b = -ldexp(1.0, 45);
+      if(b > ldexp(1.0, 45)) b = ldexp(1.0, 45);
+      int shift = 62;
+      while(shift > 0 && (ldexp(a, shift) >= ldexp(1.0, 31)-1 || ldexp(a*xmax+fabs(b), shift) >= ldexp(1.0, 62)))
+         shift--;
+      node->shift = shift;
    }
+   const double scale = ldexp(1.0, node->shift);
+   node->slope = (int32_t)(a*scale+0.5);
+   node->intercept = (int64_t)floor(b*scale+0.5);
 }
 
-void eraseNode48(Node48* node,Node** nodeRef,uint8_t keyByte) {
-   // Delete leaf from inner node
-   node->child[node->childIndex[keyByte]]=NULL;
-   node->childIndex[keyByte]=emptyMarker;
-   node->count--;
+int predict(NodeLinear* node, uint8_t* key, unsigned depth) {
+   return linearBucket(node, key+depth);
+}
 
-   if (node->count==12) {
-      // Shrink to Node16
-      Node16 *newNode=new Node16();
-      *nodeRef=newNode;
-      copyPrefix(node,newNode);
-      for (unsigned b=0;b<256;b++) {
-         if (node->childIndex[b]!=emptyMarker) {
-            newNode->key[newNode->count]=flipSign(b);
-            newNode->child[newNode->count]=node->child[node->childIndex[b]];
-            newNode->count++;
-         }
-      }
-      delete node;
+#ifdef __GNUC__
+__attribute__((target("avx2")))
+static void predictBatchAVX2(const NodeLinear* node, const uint8_t* keyBytes, unsigned n, uint8_t* buckets) {
+   // 8 predictions per step, same arithmetic as linearBucket
+   const __m256i slope = _mm256_set1_epi32(node->slope);
+   const __m256i intercept = _mm256_set1_epi32((int32_t)node->intercept);
+   const __m256i zero = _mm256_setzero_si256();
+   const __m256i last = _mm256_set1_epi32(node->fanout-1);
+   const __m256i pack = _mm256_setr_epi8(0,4,8,12,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                                         0,4,8,12,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+   unsigned i = 0;
+   for(; i+8 <= n; i += 8) {
+      __m256i x = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(keyBytes+i)));
+      __m256i y = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(x, slope), intercept), LINEAR_MODEL_SHIFT);
+      y = _mm256_min_epi32(_mm256_max_epi32(y, zero), last);
+      y = _mm256_shuffle_epi8(y, pack);
+      uint32_t lo = _mm256_extract_epi32(y, 0), hi = _mm256_extract_epi32(y, 4);
+      memcpy(buckets+i, &lo, 4);
+      memcpy(buckets+i+4, &hi, 4);
    }
+   for(; i < n; i++)
+      buckets[i] = linearBucket(node, &keyBytes[i]);
 }
 
-void eraseNode256(Node256* node,Node** nodeRef,uint8_t keyByte) {
-   // Delete leaf from inner node
-   node->child[keyByte]=NULL;
-   node->count--;
+__attribute__((target("avx512f")))
+static void predictBatchAVX512(const NodeLinear* node, const uint8_t* keyBytes, unsigned n, uint8_t* buckets) {
+   // 16 predictions per step, same arithmetic as linearBucket
+   const __m512i slope = _mm512_set1_epi32(node->slope);
+   const __m512i intercept = _mm512_set1_epi32((int32_t)node->intercept);
+   const __m512i zero = _mm512_setzero_si512();
+   const __m512i last = _mm512_set1_epi32(node->fanout-1);
+   unsigned i = 0;
+   for(; i+16 <= n; i += 16) {
+      __m512i x = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keyBytes+i)));
+      __m512i y = _mm512_srai_epi32(_mm512_add_epi32(_mm512_mullo_epi32(x, slope), intercept), LINEAR_MODEL_SHIFT);
+      y = _mm512_min_epi32(_mm512_max_epi32(y, zero), last);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(buckets+i), _mm512_cvtepi32_epi8(y));
+   }
+   for(; i < n; i++)
+      buckets[i] = linearBucket(node, &keyBytes[i]);
+}
+#endif
 
-   /*
-   if (node->count==12) {
-      // Shrink to Node16
-      Node16 *newNode=new Node16();
-      *nodeRef=newNode;
-      copyPrefix(node,newNode);
-      for (unsigned b=0;b<256;b++) {
-         if (node->child[b]) {
-            newNode->key[newNode->count]=flipSign(b);
-            newNode->child[newNode->count]=node->child[b];
-            newNode->count++;
-         }
-      }
-      delete node;
+void predictBatch(const NodeLinear* node, const uint8_t* keyBytes, unsigned n, uint8_t* buckets) {
+   // Route n key bytes through the model at once, with the vector unit of
+   // simdLevel. Only for one-byte models with at most 256 buckets
+   assert(node->keyBytes == 1 && node->fanout <= 256);
+#ifdef __GNUC__
+   int level = simdLevel();
+   if(level == 2)
+      return predictBatchAVX512(node, keyBytes, n, buckets);
+   if(level == 1)
+      return predictBatchAVX2(node, keyBytes, n, buckets);
+#endif
+   for(unsigned i=0; i<n; i++)
+      buckets[i] = linearBucket(node, &keyBytes[i]);
+}
+
+// Multi-byte models are fit on a strided sample of at most this many keys
+static const int LINEAR_SAMPLE_KEYS = 4096;
+
+static unsigned linearFanoutFor(unsigned n) {
+   // Fanout for n keys: a bucket per key, as far as the bounds allow
+   unsigned fanout = LINEAR_MIN_FANOUT;
+   while(fanout < LINEAR_MAX_FANOUT && fanout < n)
+      fanout *= 2;
+   return fanout;
+}
+
+static void learnWide(NodeLinear* node, std::vector<uint32_t>& sample) {
+   // Least-squares fit of the rank in sample (scaled to the fanout) on the
+   // keyBytes-byte key windows in sample, which is sorted here
+   std::sort(sample.begin(), sample.end());
+   double m = sample.size(), mean_x = 0, mean_y = (node->fanout*(m-1)/m)/2;
+   for(uint32_t x : sample)
+      mean_x += x;
+   mean_x /= m;
+   double s_xx = 0, s_xy = 0;
+   for(size_t j=0; j<sample.size(); j++) {
+      double dx = sample[j]-mean_x, dy = j*node->fanout/m-mean_y;
+      s_xx += dx*dx;
+      s_xy += dx*dy;
    }
-   */
+   double a = s_xx > 0 ? s_xy/s_xx : 0;
+   setLinearModel(node, a, mean_y-a*mean_x);
+
+   // Error of the stored (fixed-point, clamped) model on the sample
+   double slope = ldexp(node->slope, -node->shift), intercept = ldexp(static_cast<double>(node->intercept), -node->shift);
+   double sse = 0;
+   for(size_t j=0; j<sample.size(); j++) {
+      double residual = j*node->fanout/m-(slope*sample[j]+intercept);
+      sse += residual*residual;
+   }
+   node->fitError = sqrt(sse/m);
+}
 
-   if (node->count==NODE48_SIZE*3/4) {
-      // Shrink to Node48
-      Node48 *newNode=new Node48();
-      *nodeRef=newNode;
-      copyPrefix(node,newNode);
-      for (unsigned b=0;b<256;b++) {
-         if (node->child[b]) {
-            newNode->childIndex[b]=newNode->count;
-            newNode->child[newNode->count]=node->child[b];
-            newNode->count++;
+template<class Bucket> static void partitionInPlace(uint64_t* dataset, std::vector<int>& bucket_start, const std::vector<int>& bucket_counts, unsigned maxKeyLength, Bucket bucketOf) {
+   // Counting sort of the dataset on bucketOf(key), given the bucket sizes:
+   // every misplaced key is swapped into the next free slot of its bucket
+   // until the current slot receives one of its own
+   unsigned buckets = bucket_counts.size();
+   bucket_start.resize(buckets);
+   std::vector<int> bucket_next(buckets);
+   for(unsigned i=0, offset=0; i<buckets; i++) {
+      bucket_start[i] = bucket_next[i] = offset;
+      offset += bucket_counts[i];
+   }
+   for(unsigned i=0; i<buckets; i++) {
+      int end = bucket_start[i]+bucket_counts[i];
+      while(bucket_next[i] < end) {
+         uint64_t value = dataset[bucket_next[i]];
+         uint8_t key[maxKeyLength]; loadKey(value, key);
+         unsigned bucket = bucketOf(key);
+         while(bucket != i) {
+            std::swap(value, dataset[bucket_next[bucket]++]);
+            loadKey(value, key);
+            bucket = bucketOf(key);
          }
+         dataset[bucket_next[i]++] = value;
       }
-      delete node;
    }
-   
 }
 
-static double gettime(void) {
-  struct timeval now_tv;
-  gettimeofday (&now_tv,NULL);
-  return ((double)now_tv.tv_sec) + ((double)now_tv.tv_usec)/1000000.0;
+static Node* partitionClassic(Node** nodeRef, uint64_t* dataset, unsigned& depth, unsigned maxKeyLength, const uint8_t* firstKey, unsigned prefixLength, const int byteCounts[256], bool fallback, std::vector<int>& bucket_start, std::vector<int>& bucket_counts) {
+   // Classic node of the smallest type for the key bytes at depth (after a
+   // prefix of prefixLength bytes) with the dataset partitioned by that
+   // byte, the classic counterpart of partitionBulk
+   unsigned distinctBytes = 256-std::count(byteCounts, byteCounts+256, 0);
+   Node* classic;
+   if(distinctBytes <= (unsigned)NODE4_SIZE)
+      classic = allocNode<Node4>();
+   else if(distinctBytes <= 16)
+      classic = allocNode<Node16>();
+   else if(distinctBytes <= 32)
+      classic = allocNode<Node32>();
+   else if(distinctBytes <= (unsigned)NODE48_SIZE)
+      classic = allocNode<Node48>();
+   else
+      classic = allocNode<Node256>();
+   classic->prefixLength = prefixLength;
+   memcpy(classic->prefix, firstKey+depth-prefixLength, min(prefixLength,maxPrefixLength));
+   classic->fallback = fallback;
+   // Children in key order never move, bulkSlot finds their slots
+   Node* ref = classic;
+   for(unsigned b=0; b<256; b++)
+      if(byteCounts[b])
+         insertChild(classic, &ref, b, NULL);
+   *nodeRef = classic;
+   bucket_counts.assign(byteCounts, byteCounts+256);
+   unsigned byteDepth = depth;
+   partitionInPlace(dataset, bucket_start, bucket_counts, maxKeyLength, [byteDepth](const uint8_t* key) { return key[byteDepth]; });
+   depth++;
+   return classic;
 }
 
-void learn2(NodeLinear* node, uint64_t* dataset, int n, unsigned depth) {
-   int counts[256] = {0};
-   for(int i=0; i<n; i++) {
-      uint8_t key[8]; loadKey(dataset[i], key);
-      counts[key[depth]]++;
+Node* partitionBulk(Node* node, Node** nodeRef, uint64_t* dataset, int n, unsigned& depth, unsigned maxKeyLength, std::vector<int>& bucket_start, std::vector<int>& bucket_counts) {
+   // Train a NodeLinear for dataset[0..n) (n > 8), or build a classic node
+   // if the fit splits the keys worse than the next key byte does, and
+   // partition the dataset in place. On return depth is the depth of the
+   // children and bucket i is dataset[bucket_start[i]..+bucket_counts[i]),
+   // linked at bulkSlot(node,i). A node passed in (a NodeLinear) is reused.
+   bool reused = node != NULL;
+
+   // Longest common prefix of all keys, found in a single pass
+   uint8_t firstKey[maxKeyLength];loadKey(dataset[0], firstKey);
+   unsigned newPrefixLength = min(maxPrefixLength, maxKeyLength-depth);
+   for(int i=1; i<n && newPrefixLength; i++) {
+      uint8_t key[maxKeyLength];loadKey(dataset[i], key);
+      for(unsigned pos=0; pos<newPrefixLength; pos++)
+         if(key[depth+pos] != firstKey[depth+pos]) {
+            newPrefixLength = pos;
+            break;
+         }
+   }
+   unsigned keyDepth = depth+newPrefixLength;
+
+   // Shape of the node: the fanout follows n, the model reads as many key
+   // bytes as needed to tell that many buckets apart. Variable-length keys
+   // are undefined past their terminator, their models stay at one byte
+   unsigned windowBytes = maxKeyLength > 8 ? 1 : std::min(LINEAR_MAX_KEY_BYTES, maxKeyLength-keyDepth);
+   std::vector<uint32_t> sample;
+   bool seen[256] = {};
+   unsigned distinct = 0;
+   int stride = (n+LINEAR_SAMPLE_KEYS-1)/LINEAR_SAMPLE_KEYS;
+   for(int i=0; i<n; i+=stride) {
+      uint8_t key[maxKeyLength];loadKey(dataset[i], key);
+      uint32_t window = 0;
+      for(unsigned b=0; b<windowBytes; b++)
+         window = (window<<8)|key[keyDepth+b];
+      sample.push_back(window);
+      uint8_t first = key[keyDepth];
+      distinct += !seen[first];
+      seen[first] = true;
+   }
+   unsigned fanout = node ? static_cast<NodeLinear*>(node)->fanout : linearFanoutFor(n);
+   unsigned keyBytes = 1;
+   for(uint64_t reach = distinct; keyBytes < windowBytes && reach < fanout; reach *= 256)
+      keyBytes++;
+   if(keyBytes == 1 && !node)
+      while(fanout > LINEAR_MIN_FANOUT && fanout/2 >= distinct)
+         fanout /= 2;
+
+   depth=keyDepth;
+   int byteCounts[256] = {0};
+   if(!learnedNodes && !reused) {
+      // Built without learned nodes: only the classic node, on the byte
+      for(int i=0; i<n; i++) {
+         uint8_t key[maxKeyLength]; loadKey(dataset[i], key);
+         byteCounts[key[depth]]++;
+      }
+      return partitionClassic(nodeRef, dataset, depth, maxKeyLength, firstKey, newPrefixLength, byteCounts, false, bucket_start, bucket_counts);
    }
 
-   // for(int i=0; i<128; i++) {
-   //    if (counts[i]) printf("%d: %d\n", i, counts[i]);
-   // }
+   if(node == NULL)
+      node = allocLinear(fanout);
+   *nodeRef = node;
+   NodeLinear *linearNode = static_cast<NodeLinear*>(node);
+   linearNode->keyBytes = keyBytes;
+   linearNode->prefixLength=newPrefixLength;
+   memcpy(linearNode->prefix,firstKey+keyDepth-newPrefixLength, min(newPrefixLength,maxPrefixLength));
+
+   if(keyBytes == 1) {
+      learn2(linearNode, dataset, n, depth, maxKeyLength);
+   } else {
+      for(uint32_t& window : sample)
+         window >>= 8*(windowBytes-keyBytes);
+      learnWide(linearNode, sample);
+   }
 
-   int s_x=0, s_y=0, s_xy=0, s_x2=0, s_y2=0;
-   int bucket_size = n/LINEAR_SIZE + 1;
+   // Prediction pass, fills the bucket histogram and that of the key byte
+   // a classic node would branch on
+   bucket_counts.assign(fanout, 0);
+   if(keyBytes == 1 && fanout <= 256) {
+      for(int i=0; i<n; i+=64) {
+         uint8_t bytes[64], buckets[64];
+         unsigned batch = std::min(n-i, 64);
+         for(unsigned j=0; j<batch; j++) {
+            uint8_t key[maxKeyLength]; loadKey(dataset[i+j], key);
+            bytes[j] = key[depth];
+            byteCounts[bytes[j]]++;
+         }
+         predictBatch(linearNode, bytes, batch, buckets);
+         for(unsigned j=0; j<batch; j++)
+            bucket_counts[buckets[j]]++;
+      }
+   } else {
+      for(int i=0; i<n; i++) {
+         uint8_t key[maxKeyLength]; loadKey(dataset[i], key);
+         bucket_counts[predict(linearNode, key, depth)]++;
+         byteCounts[key[depth]]++;
+      }
+   }
 
-   int current_x = 0;
-   while(counts[current_x] == 0) current_x++;
+   // The learned node is kept if its fullest bucket holds fewer keys than
+   // the fullest child of a classic node on the same byte. Otherwise the
+   // classic node is built, which also ends the recursion for fits that
+   // send every key to one bucket
+   int fullest = *std::max_element(bucket_counts.begin(), bucket_counts.end());
+   int fullestByte = *std::max_element(byteCounts, byteCounts+256);
+   if(fullest >= fullestByte && !reused) {
+      freeNode(linearNode);
+      return partitionClassic(nodeRef, dataset, depth, maxKeyLength, firstKey, newPrefixLength, byteCounts, true, bucket_start, bucket_counts);
+   }
 
-   int current_y = 0;
-   int bucket_progress = 0;
-   int count_progress = 0;
+   for(unsigned i=0; i<fanout; i++) {
+      linearOccupancy(linearNode)[i] = bucket_counts[i];
+      if(bucket_counts[i])
+         linearNode->count++;
+   }
+   linearNode->size = linearNode->trained = n;
+   linearNode->misses = 0;
+   partitionInPlace(dataset, bucket_start, bucket_counts, maxKeyLength, [linearNode, depth](const uint8_t* key) { return linearBucket(linearNode, key+depth); });
+   return linearNode;
+}
 
-   for(int i=0; i<n; i++) {
-      s_x += current_x;
-      s_y += current_y;
-      s_x2 += current_x*current_x;
-      s_y2 += current_y*current_y;
-      s_xy += current_x*current_y;
-      //printf("predicting x: %d, y: %d\n", current_x, current_y);
+static Node** bulkSlot(Node* node, unsigned bucket) {
+   // Child slot of bucket i of a node built by partitionBulk: a linear
+   // bucket or the child for key byte i, &nullNode for an absent byte
+   if(node->type == NodeTypeLinear)
+      return &linearChildren(static_cast<NodeLinear*>(node))[bucket];
+   return findChildByte(node, bucket);
+}
 
-      count_progress++;
-      bucket_progress++;
+// Sub-range dataset[0..n) of a bulk load, still to be built below nodeRef
+struct BulkTask {
+   Node** nodeRef;
+   uint64_t* dataset;
+   int n;
+   unsigned depth;
+};
+
+static void insertSmall(Node** nodeRef, uint64_t* dataset, int n, unsigned depth, unsigned maxKeyLength) {
+   // Subtree for at most 8 keys, built by hinted inserts. It holds no
+   // linear node, so the inserts never rebuild and re-enter a bulk load
+   // that would share the hint.
+   static thread_local InsertHint hint;
+   hint.path.clear();
+   hint.key.clear();
+   *nodeRef = makeLeaf(dataset[0]);
+   for (int i=1; i<n; i++) {
+      uint8_t key[maxKeyLength];loadKey(dataset[i], key);
+      insertFrom(nodeRef, key, depth, dataset[i], maxKeyLength, hint);
+   }
+}
 
-      if(count_progress == counts[current_x]) {
-         current_x++;
-         while(counts[current_x] == 0) current_x++;
-         count_progress = 0;
+void insertBulk(Node* node, Node** nodeRef, uint64_t* dataset, int n, unsigned depth, unsigned maxKeyLength) {
+   // Build the subtree for dataset[0..n) below nodeRef. The dataset is
+   // permuted in place; the buckets still to build wait on an explicit
+   // stack as sub-ranges of the same buffer, lower buckets first
+   std::vector<BulkTask> stack;
+   stack.push_back({nodeRef, dataset, n, depth});
+   std::vector<int> bucket_start, bucket_counts;
+   while (!stack.empty()) {
+      BulkTask task = stack.back();
+      stack.pop_back();
+      if (task.n <= 0)
+         continue;
+      if (task.n <= 8) {
+         insertSmall(task.nodeRef, task.dataset, task.n, task.depth, maxKeyLength);
+         continue;
       }
+      // Only the root of the load may reuse a node
+      Node* inner = partitionBulk(node, task.nodeRef, task.dataset, task.n, task.depth, maxKeyLength, bucket_start, bucket_counts);
+      node = NULL;
+      for(unsigned i=bucket_counts.size(); i-->0;)
+         if(bucket_counts[i])
+            stack.push_back({bulkSlot(inner, i), task.dataset+bucket_start[i], bucket_counts[i], task.depth});
+   }
+}
+
+// Lazy bulk loading: buckets with at most this many keys are built right
+// away, a NodeLazy would not save enough to pay for the extra step
+static const int LAZY_MIN_KEYS = 64;
 
-      if(bucket_progress == bucket_size) {
-         current_y++;
-         bucket_progress = 0;
+static void insertBulkLevel(Node** nodeRef, uint64_t* dataset, int n, unsigned depth, unsigned maxKeyLength) {
+   // One level of a lazy bulk load: the inner node for dataset[0..n) with
+   // lazy children for its larger buckets
+   if (n <= LAZY_MIN_KEYS) {
+      insertBulk(NULL, nodeRef, dataset, n, depth, maxKeyLength);
+      return;
+   }
+   std::vector<int> bucket_start, bucket_counts;
+   Node* inner = partitionBulk(NULL, nodeRef, dataset, n, depth, maxKeyLength, bucket_start, bucket_counts);
+   for(unsigned i=0; i<bucket_counts.size(); i++) {
+      if (bucket_counts[i] == 0)
+         continue;
+      if (bucket_counts[i] <= LAZY_MIN_KEYS) {
+         insertBulk(NULL, bulkSlot(inner, i), dataset+bucket_start[i], bucket_counts[i], depth, maxKeyLength);
+         continue;
       }
+      NodeLazy* lazy = allocNode<NodeLazy>();
+      lazy->keys = dataset+bucket_start[i];
+      lazy->size = bucket_counts[i];
+      lazy->depth = depth;
+      lazy->maxKeyLength = maxKeyLength;
+      lazy->loader = getKeyLoader();
+      *bulkSlot(inner, i) = lazy;
    }
+}
 
-
-   double a = (1.0*n*s_xy - 1.0*s_x*s_y)/(1.0*n*s_x2 - 1.0*s_x*s_x);
-   double b = (1.0*s_y*s_x2 - 1.0*s_x*s_xy)/(1.0*n*s_x2 - 1.0*s_x*s_x);
-   printf("y = %fx + %f\n", a, b);
-   // printf("%p\n", node->child);
-   node->a = a;
-   node->b = b;
-   return;
+void insertBulkLazy(Node** root, uint64_t* keys, size_t n, unsigned maxKeyLength) {
+   // Lazily bulk load the sorted keys into the empty tree at root
+   assert(n <= static_cast<size_t>(INT32_MAX));
+   insertBulkLevel(root, keys, n, 0, maxKeyLength);
 }
 
-void learn(NodeLinear* node, uint64_t* dataset, int n, unsigned depth) {
-   int counts[256] = {0};
-   for(int i=0; i<n; i++) {
-      uint8_t key[8]; loadKey(dataset[i], key);
-      counts[key[depth]]++;
-   }
-
-   for(int i=0; i<128; i++) {
-      printf("%d: %d\n", i, counts[i]);
-   }
-
-   // veryyy simple linear regression code
-   int s_x=0, s_y=0, s_xy=0, s_x2=0, s_y2=0;
-   int bucket_size = n/LINEAR_SIZE + 1;
-   if(bucket_size == 0) bucket_size = 1;
-   // printf("bucket_size: %d\n", bucket_size);
-   int y=0;
-   for(int i=0; i<256; i++) {
-      // printf("i: %d, counts[i]: %d\n", i, counts[i]);
-      s_x += counts[i]*i;
-      s_x2 += counts[i]*i*i;
-
-      int i_count=counts[i];
-      while(i_count > 0) {
-         // printf("i_count: %d, y: %d, bucket_size: %d\n", i_count, y, bucket_size);
-         printf("value %i expected in bucket %i\n", i, y);
-         if(i_count >= bucket_size) {
-            s_y += bucket_size*y;
-            s_y2 += bucket_size*y*y;
-            s_xy += bucket_size*i*y;
-
-            y++;
-            i_count -= bucket_size;
-            bucket_size -= bucket_size;
-         } else {
-            s_y += i_count*y;
-            s_y2 += i_count*y*y;
-            s_xy += i_count*i*y;
+Node* materializeLazy(Node** nodeRef) {
+   // Replace the lazy node at nodeRef by the next level of its subtree,
+   // using the key loader of the bulk load
+   NodeLazy* lazy = static_cast<NodeLazy*>(*nodeRef);
+   uint64_t* keys = lazy->keys;
+   int n = lazy->size;
+   unsigned depth = lazy->depth, maxKeyLength = lazy->maxKeyLength;
+   KeyLoader previous = setKeyLoader(lazy->loader);
+   freeNode(lazy);
+   *nodeRef = NULL;
+   insertBulkLevel(nodeRef, keys, n, depth, maxKeyLength);
+   setKeyLoader(previous);
+   return *nodeRef;
+}
 
-            bucket_size -= i_count;
-            i_count -= i_count;
+void materializeTree(Node** root) {
+   // Build all pending subtrees of a lazily loaded tree
+   std::vector<Node**> stack;
+   stack.push_back(root);
+   while (!stack.empty()) {
+      Node* node = loadLazy(stack.back());
+      stack.pop_back();
+      if (!node || isLeaf(node))
+         continue;
+      switch (node->type) {
+         case NodeType4: {
+            Node4* n = static_cast<Node4*>(node);
+            for (unsigned i=0; i<n->count; i++)
+               stack.push_back(&n->child[i]);
+            break;
+         }
+         case NodeType16: {
+            Node16* n = static_cast<Node16*>(node);
+            for (unsigned i=0; i<n->count; i++)
+               stack.push_back(&n->child[i]);
+            break;
+         }
+         case NodeType32: {
+            Node32* n = static_cast<Node32*>(node);
+            for (unsigned i=0; i<n->count; i++)
+               stack.push_back(&n->child[i]);
+            break;
+         }
+         case NodeType48: {
+            Node48* n = static_cast<Node48*>(node);
+            for (unsigned i=0; i<NODE48_SIZE; i++)
+               stack.push_back(&n->child[i]);
+            break;
+         }
+         case NodeType256: {
+            Node256* n = static_cast<Node256*>(node);
+            for (unsigned i=0; i<256; i++)
+               stack.push_back(&n->child[i]);
+            break;
          }
-         if (bucket_size == 0) {
-            bucket_size = n/LINEAR_SIZE;
-            if(bucket_size == 0) bucket_size = 1;
+         case NodeTypeLinear: {
+            NodeLinear* n = static_cast<NodeLinear*>(node);
+            for (unsigned i=0;i<n->fanout;i++)
+               stack.push_back(&linearChildren(n)[i]);
+            break;
          }
       }
    }
-   // printf("bucket size: %d, y: %d\n", bucket_size, y);
-   // printf("s_x: %d, s_y: %d\n", s_x, s_y);
-   // printf("s_x2: %d, s_y2: %d\n", s_x2, s_y2);
+}
 
-   double a = (n*s_xy - s_x*s_y)*1.0/(n*s_x2 - s_x*s_x);
-   double b = (s_y*s_x2 - s_x*s_xy)*1.0/(n*s_x2 - s_x*s_x);
-   printf("y = %fx + %f\n", a, b);
-   // printf("%p\n", node->child);
-   node->a = a;
-   node->b = b;
-   return;
+// Subtrees with more keys than this are handed to the pool, smaller ones
+// are built by the thread that partitioned their parent
+static const int BULK_PARALLEL_THRESHOLD = 1<<16;
+
+struct BulkPool {
+   // One deque per worker: the owner pushes and pops at the back, thieves
+   // take from the front (the oldest, and thus largest, subtrees)
+   std::vector<std::deque<BulkTask>> queues;
+   std::vector<std::mutex> locks;
+   std::atomic<long> pending;
+   unsigned maxKeyLength;
+
+   BulkPool(unsigned threads,unsigned maxKeyLength) : queues(threads),locks(threads),pending(0),maxKeyLength(maxKeyLength) {}
+};
+
+static void pushBulkTask(BulkPool* pool, unsigned self, BulkTask task) {
+   pool->pending++;
+   std::lock_guard<std::mutex> guard(pool->locks[self]);
+   pool->queues[self].push_back(task);
 }
 
-int predict(NodeLinear* node, uint8_t* key, unsigned depth) {
-   // printf("%f*%d + %f = %f\n", node->a, key[depth], node->b, node->a*key[depth] + node->b);
-   int bucket = (int)(node->a*key[depth] + node->b);
-   // printf("determined bucket is %d\n", bucket);
-   if(bucket < 0) return 0;
-   if(bucket >= LINEAR_SIZE) return LINEAR_SIZE-1;
-   return bucket;
-}
-
-void insertBulk(Node* node, Node** nodeRef, uint64_t* dataset, int n, unsigned depth) {
-   // for(int i=0; i<n; i++) {
-   //    printf("value: %d\n", dataset[i]);
-   // }
-   // printf("n: %d\n", n);
-   if(n <= 8 && n > 1) {
-      // printf("inserting into nodes\n");
-      for (uint64_t i=1; i<n; i++) {
-         uint8_t key[8];loadKey(dataset[i], key);
-         // for(int j=0; j<8; j++) {
-         //    printf("%d ", key[j]);
-         // }
-         // printf("\n");
-         insert(*nodeRef, nodeRef, key, depth, dataset[i], 8);
+static bool popBulkTask(BulkPool* pool, unsigned self, BulkTask& task) {
+   // Take from the own queue first, then try to steal from the others
+   unsigned threads = pool->queues.size();
+   for(unsigned i=0; i<threads; i++) {
+      unsigned victim = (self+i)%threads;
+      std::lock_guard<std::mutex> guard(pool->locks[victim]);
+      std::deque<BulkTask>& queue = pool->queues[victim];
+      if(queue.empty())
+         continue;
+      if(victim == self) {
+         task = queue.back();
+         queue.pop_back();
+      } else {
+         task = queue.front();
+         queue.pop_front();
       }
-      return;
-   } else if (n <= 1) {
-      return;
+      return true;
    }
+   return false;
+}
 
-   if(node == NULL) {
-      NodeLinear *newNode = new NodeLinear();
-      *nodeRef = newNode;
+static void runBulkTask(BulkPool* pool, unsigned self, BulkTask task) {
+   // Same construction as insertBulk, but large buckets become new tasks
+   if(task.n <= BULK_PARALLEL_THRESHOLD) {
+      insertBulk(NULL, task.nodeRef, task.dataset, task.n, task.depth, pool->maxKeyLength);
+      return;
    }
 
-   NodeLinear *linearNode = static_cast<NodeLinear*>(node);
+   std::vector<int> bucket_start, bucket_counts;
+   Node* inner = partitionBulk(NULL, task.nodeRef, task.dataset, task.n, task.depth, pool->maxKeyLength, bucket_start, bucket_counts);
+   for(unsigned i=0; i<bucket_counts.size(); i++) {
+      if(bucket_counts[i] == 0)
+         continue;
+      BulkTask child = {bulkSlot(inner, i), task.dataset+bucket_start[i], bucket_counts[i], task.depth};
+      if(child.n > BULK_PARALLEL_THRESHOLD)
+         pushBulkTask(pool, self, child);
+      else
+         insertBulk(NULL, child.nodeRef, child.dataset, child.n, child.depth, pool->maxKeyLength);
+   }
+}
 
-   unsigned newPrefixLength=0;
-   unsigned prefixMatch = 0;
-   uint8_t prefix = 0;
-   while(prefixMatch != 1 && newPrefixLength < maxPrefixLength) {
-      // printf("depth: %d, prefix length: %d\n", depth, newPrefixLength);
-      for(uint64_t i=0; i<n; i++) {
-         uint8_t key[8];loadKey(dataset[i], key);
-         if(i==0) prefix = key[depth+newPrefixLength];
-         if(key[depth+newPrefixLength] != prefix) {
-            prefixMatch = 1;
-            break;
-         }
+static void bulkWorker(BulkPool* pool, unsigned self, Arena* arena, KeyLoader loader) {
+   // Workers allocate from the arena and load keys with the loader of the
+   // thread that started the build
+   setArena(arena);
+   setKeyLoader(loader);
+   while(pool->pending.load() > 0) {
+      BulkTask task;
+      if(popBulkTask(pool, self, task)) {
+         runBulkTask(pool, self, task);
+         pool->pending--;
+      } else {
+         std::this_thread::yield();
       }
+   }
+}
 
-      if(prefixMatch != 1) {
-         newPrefixLength++;
-      }
+void insertBulkParallel(Node** root, uint64_t* keys, size_t n, unsigned threads, unsigned maxKeyLength) {
+   // Parallel version of insertBulk(NULL, root, keys, n, 0, maxKeyLength), builds the
+   // same tree. The calling thread takes part as worker 0.
+   assert(n <= static_cast<size_t>(INT32_MAX));
+   if(threads == 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+   if(threads == 1 || n <= (size_t)BULK_PARALLEL_THRESHOLD) {
+      insertBulk(NULL, root, keys, n, 0, maxKeyLength);
+      return;
    }
 
-   linearNode->prefixLength=newPrefixLength;
-   uint8_t key[8];loadKey(dataset[0], key);
-   memcpy(linearNode->prefix,key+depth, min(newPrefixLength,maxPrefixLength));
-   depth+=linearNode->prefixLength;
+   BulkPool pool(threads, maxKeyLength);
+   BulkTask task = {root, keys, (int)n, 0};
+   pushBulkTask(&pool, 0, task);
 
-   learn2(linearNode, dataset, n, depth);
+   std::vector<std::thread> workers;
+   for(unsigned i=1; i<threads; i++)
+      workers.push_back(std::thread(bulkWorker, &pool, i, getArena(), getKeyLoader()));
+   bulkWorker(&pool, 0, getArena(), getKeyLoader());
+   for(unsigned i=0; i<workers.size(); i++)
+      workers[i].join();
+}
+
+// Keys read per step of a streaming bulk load, also the most keys of one
+// bucket it keeps in memory
+static const size_t BULK_STREAM_CHUNK = 1<<20;
 
-   int bucket_counts[LINEAR_SIZE] = {0};
+struct StreamBucket {
+   // Bucket of the streamed root whose keys are at the front of the buffer
+   unsigned bucket;
+   size_t pending;
+};
 
-   for(int i=0; i<n; i++) {
-      uint8_t key[8]; loadKey(dataset[i], key);
-      // printf("predicting...\n");
-      int bucket = predict(linearNode, key, depth);
-      //printf("bucket prediction for %d is %d\n", dataset[i], bucket);
-      bucket_counts[bucket]++;
+static void flushStreamBucket(NodeLinear* root, unsigned bucket, uint64_t* keys, size_t n, unsigned depth, unsigned maxKeyLength, std::vector<uint8_t>& keyBytes) {
+   // Add the sorted keys of one bucket to its subtree: a bulk load into
+   // an empty bucket, a merge once an earlier chunk started it
+   if(n == 0)
+      return;
+   Node** slot = &linearChildren(root)[bucket];
+   if(*slot == NULL) {
+      insertBulk(NULL, slot, keys, n, depth, maxKeyLength);
+      root->count++;
+   } else {
+      keyBytes.resize(n*maxKeyLength);
+      for(size_t i=0; i<n; i++)
+         loadKey(keys[i], keyBytes.data()+i*maxKeyLength);
+      mergeRange(slot, keys, keyBytes.data(), n, depth, maxKeyLength);
    }
+   uint32_t& occupancy = linearOccupancy(root)[bucket];
+   occupancy = std::min<uint64_t>(UINT32_MAX, static_cast<uint64_t>(occupancy)+n);
+   root->size = std::min<uint64_t>(UINT32_MAX, static_cast<uint64_t>(root->size)+n);
+}
 
-   // for(int i=0; i<LINEAR_SIZE; i++) {
-   //    printf("bucket %d has count %d\n", i, bucket_counts[i]);
-   // }
+void insertBulkStream(Node** root, KeyReader reader, void* context, uint64_t n, const uint64_t* sample, size_t sampleSize, unsigned maxKeyLength) {
+   // Streaming insertBulk into an empty tree. The root NodeLinear is fit
+   // on the sample; buckets are contiguous in sorted order, so each one is
+   // built once its keys have streamed into the buffer, and a bucket that
+   // outgrows the buffer is merged chunk by chunk
+   assert(*root == NULL);
+   std::vector<uint64_t> buffer;
+   if(!learnedNodes) {
+      // No root model to route by: every chunk is merged into the tree,
+      // which also upserts duplicates across chunks
+      buffer.resize(BULK_STREAM_CHUNK);
+      size_t got;
+      while((got = reader(context, buffer.data(), buffer.size())))
+         mergeBatch(root, buffer.data(), std::unique(buffer.begin(), buffer.begin()+got)-buffer.begin(), maxKeyLength);
+      return;
+   }
+   if(n <= BULK_STREAM_CHUNK || sampleSize <= 8) {
+      // Small enough to load in one piece
+      buffer.resize(std::max<uint64_t>(n, 1));
+      size_t size = 0, got;
+      while(size < buffer.size() && (got = reader(context, buffer.data()+size, buffer.size()-size)))
+         size += got;
+      buffer.resize(std::unique(buffer.begin(), buffer.begin()+size)-buffer.begin());
+      insertBulk(NULL, root, buffer.data(), buffer.size(), 0, maxKeyLength);
+      return;
+   }
 
-   for(int i=0; i<LINEAR_SIZE; i++) {
-      uint64_t *bucket_data = new uint64_t[bucket_counts[i]];
-      int idx = 0;
-      for(int j=0; j<n; j++) {
-         uint8_t key[8];loadKey(dataset[j], key);
-         if(i == predict(linearNode, key, depth)) {
-            bucket_data[idx] = dataset[j];
-            idx++;
+   // The model and prefix of the root come from the sample, which holds
+   // the first and last key; its bucket counts are replaced by the real ones
+   std::vector<uint64_t> train(sample, sample+sampleSize);
+   std::vector<int> bucket_start, bucket_counts;
+   unsigned depth = 0;
+   NodeLinear* node = allocLinear(linearFanoutFor(std::min<uint64_t>(n, UINT32_MAX)));
+   partitionBulk(node, root, train.data(), train.size(), depth, maxKeyLength, bucket_start, bucket_counts);
+   memset(linearOccupancy(node), 0, node->fanout*sizeof(uint32_t));
+   node->count = 0;
+   node->size = 0;
+
+   buffer.resize(BULK_STREAM_CHUNK);
+   std::vector<uint8_t> keyBytes;
+   StreamBucket current = {0, 0};
+   bool any = false;
+   uint64_t last = 0;
+   for(;;) {
+      size_t got = reader(context, buffer.data()+current.pending, BULK_STREAM_CHUNK-current.pending);
+      if(got == 0)
+         break;
+      // Drop duplicates, then cut the chunk into runs of one bucket; all
+      // but the last run are complete
+      size_t end = current.pending;
+      for(size_t i=current.pending; i<current.pending+got; i++) {
+         if(any && buffer[i] == last)
+            continue;
+         last = buffer[end++] = buffer[i];
+         any = true;
+      }
+      size_t start = 0;
+      for(size_t i=current.pending; i<end; i++) {
+         uint8_t key[maxKeyLength]; loadKey(buffer[i], key);
+         unsigned bucket = linearBucket(node, key+depth);
+         assert(bucket >= current.bucket);
+         if(bucket != current.bucket) {
+            flushStreamBucket(node, current.bucket, buffer.data()+start, i-start, depth, maxKeyLength, keyBytes);
+            start = i;
+            current.bucket = bucket;
          }
       }
-      if(bucket_counts[i] > 8) {
-         linearNode->child[i] = static_cast<Node*>(new NodeLinear());
-         insertBulk(linearNode->child[i], &linearNode->child[i], bucket_data, bucket_counts[i], depth);
-      } else if (bucket_counts[i] != 0){
-         // printf("pre-inserting %d\n", bucket_data[0]);
-         linearNode->child[i] = makeLeaf(bucket_data[0]);
-         insertBulk(linearNode->child[i], &linearNode->child[i], bucket_data, bucket_counts[i], depth);
+      current.pending = end-start;
+      if(current.pending == BULK_STREAM_CHUNK) {
+         flushStreamBucket(node, current.bucket, buffer.data(), current.pending, depth, maxKeyLength, keyBytes);
+         current.pending = 0;
+      } else {
+         memmove(buffer.data(), buffer.data()+start, current.pending*sizeof(uint64_t));
       }
    }
-   return;
+   if(current.pending)
+      flushStreamBucket(node, current.bucket, buffer.data(), current.pending, depth, maxKeyLength, keyBytes);
+   node->trained = node->size;
 }
 
-int main(int argc,char** argv) {
-   if (argc!=3) {
-      printf("usage: %s n 0|1|2\nn: number of keys\n0: sorted keys\n1: dense keys\n2: sparse keys\n", argv[0]);
-      return 1;
-   }
-
-   uint64_t n=atoi(argv[1]);
-   uint64_t* keys=new uint64_t[n];
-
-   // Generate keys
-   for (uint64_t i=0;i<n;i++)
-      // dense, sorted
-      keys[i]=i+1;
-   if (atoi(argv[2])==1)
-      // dense, random
-      std::random_shuffle(keys,keys+n);
-   if (atoi(argv[2])==2)
-      // "pseudo-sparse" (the most-significant leaf bit gets lost)
-      for (uint64_t i=0;i<n;i++)
-         keys[i]=(static_cast<uint64_t>(rand())<<32) | static_cast<uint64_t>(rand());
-
-   // Build tree
-   double start = gettime();
-   Node* tree=NULL;
-   if(n > 8) tree = static_cast<Node*>(new NodeLinear());
-   // printf("%d\n", isLeaf(tree));
-   // for (uint64_t i=0;i<n;i++) {
-   //    uint8_t key[8];loadKey(keys[i],key);
-   //    insert(tree,&tree,key,0,keys[i],8);
-   // }
-   insertBulk(tree, &tree, keys, n, 0);
-   // printf("is leaf: %d\n", isLeaf(tree));
-   printf("insert,%ld,%f\n",n,(n/1000000.0)/(gettime()-start));
-   profile(tree);
-
-   // Repeat lookup for small trees to get reproducable results
-   uint64_t repeat=10000000/n;
-   if (repeat<1)
-      repeat=1;
-   start = gettime();
-   for (uint64_t r=0;r<repeat;r++) {
-      for (uint64_t i=0;i<n;i++) {
-         uint8_t key[8];loadKey(keys[i],key);
-         Node* leaf=lookup(tree,key,8,0,8);
-         // printf("%p\n", leaf);
-         assert(isLeaf(leaf));
-         // printf("%d %d\n", getLeafValue(leaf), keys[i]);
-         assert(getLeafValue(leaf)==keys[i]);
-      }
-   }
-   printf("lookup,%ld,%f\n",n,(n*repeat/1000000.0)/(gettime()-start));
-
-   start = gettime();
-   for (uint64_t i=0;i<n;i++) {
-      uint8_t key[8];loadKey(keys[i],key);
-      erase(tree,&tree,key,8,0,8);
-   }
-   printf("erase,%ld,%f\n",n,(n/1000000.0)/(gettime()-start));
-   assert(tree==NULL);
+struct FileKeys {
+   int fd;
+   // file offsets of the next key and of the end
+   off_t next, end;
+   // keys read so far
+   uint64_t read;
+};
+
+static size_t readFileKeys(void* context, uint64_t* keys, size_t max) {
+   // KeyReader over a SOSD file, chunked reads
+   FileKeys* file = static_cast<FileKeys*>(context);
+   size_t want = std::min<uint64_t>(max, (file->end-file->next)/sizeof(uint64_t));
+   ssize_t got = want ? pread(file->fd, keys, want*sizeof(uint64_t), file->next) : 0;
+   if(got <= 0)
+      return 0;
+   file->next += got/sizeof(uint64_t)*sizeof(uint64_t);
+   file->read += got/sizeof(uint64_t);
+   return got/sizeof(uint64_t);
+}
 
-   return 0;
+bool insertBulkFile(Node** root, const char* path, unsigned maxKeyLength, uint64_t* loaded) {
+   // Streaming bulk load of the sorted keys of a SOSD file (a uint64 count,
+   // then the keys) into an empty tree; the sample is read key by key.
+   // False if the file cannot be read or holds keys with the top bit set,
+   // which leaves cannot store. The keys read go to *loaded
+   *loaded = 0;
+   int fd = open(path, O_RDONLY);
+   if(fd < 0)
+      return false;
+   uint64_t n = 0, lastKey = 0;
+   struct stat st;
+   bool ok = fstat(fd, &st) == 0 && pread(fd, &n, sizeof(n), 0) == sizeof(n) && static_cast<uint64_t>(st.st_size) >= (n+1)*sizeof(uint64_t);
+   if(ok && n)
+      ok = pread(fd, &lastKey, sizeof(lastKey), n*sizeof(uint64_t)) == sizeof(lastKey) && !(lastKey>>63);
+   std::vector<uint64_t> sample;
+   uint64_t samples = std::min<uint64_t>(n, LINEAR_SAMPLE_KEYS);
+   for(uint64_t j=0; ok && j<samples; j++) {
+      uint64_t i = samples > 1 ? j*(n-1)/(samples-1) : 0, key;
+      ok = pread(fd, &key, sizeof(key), (i+1)*sizeof(uint64_t)) == sizeof(key);
+      sample.push_back(key);
+   }
+   if(ok) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      FileKeys file = {fd, static_cast<off_t>(sizeof(uint64_t)), static_cast<off_t>((n+1)*sizeof(uint64_t)), 0};
+      insertBulkStream(root, readFileKeys, &file, n, sample.data(), sample.size(), maxKeyLength);
+      *loaded = file.read;
+   }
+   close(fd);
+   return ok;
 }
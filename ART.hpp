@@ -2,10 +2,18 @@
 #include <string.h>    // memset, memcpy
 #include <stdint.h>    // integer types
 #include <emmintrin.h> // x86 SSE intrinsics
+#include <immintrin.h> // x86 AVX2 intrinsics
 #include <stdio.h>
 #include <assert.h>
 #include <sys/time.h>  // gettime
 #include <algorithm>   // std::random_shuffle
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <new>
+#ifdef ART_ICU
+#include <unicode/ucol.h>
+#endif
 
 // Constants for the node types
 static const int8_t NodeType4=0;
@@ -13,35 +21,99 @@ static const int8_t NodeType16=1;
 static const int8_t NodeType48=2;
 static const int8_t NodeType256=3;
 static const int8_t NodeTypeLinear=4;
+static const int8_t NodeTypeLazy=5;
+static const int8_t NodeType32=6;
+static const int8_t NodeTypeCount=7;
+// Names of the node types in statistics and reports
+extern const char* const nodeTypeNames[NodeTypeCount];
 
 // The maximum prefix length for compressed paths stored in the
 // header, if the path is longer it is loaded from the database on
-// demand
-static const unsigned maxPrefixLength=9;
+// demand. Configurable with -DART_MAX_PREFIX_LENGTH=n; 8-byte keys never
+// have prefixes longer than 7 bytes, so any n>=7 avoids loading keys.
+#ifndef ART_MAX_PREFIX_LENGTH
+#define ART_MAX_PREFIX_LENGTH 9
+#endif
+static const unsigned maxPrefixLength=ART_MAX_PREFIX_LENGTH;
 
-static const int8_t NODE4_SIZE = 4;
-static const int8_t NODE48_SIZE = 24;
+// Bulk loads build learned NodeLinear nodes where they split the keys
+// better than the classic nodes; -DART_LEARNED_NODES=0 builds classic
+// nodes only (for comparisons)
+#ifndef ART_LEARNED_NODES
+#define ART_LEARNED_NODES 1
+#endif
+static const bool learnedNodes=ART_LEARNED_NODES;
+
+// Widest vector unit the library uses: 0 for SSE2, 1 for AVX2, 2 for
+// AVX-512. Kernels are picked at run time up to the level of the machine,
+// the inline Node32 compares use AVX2 where the build targets it
+#ifndef ART_SIMD_MAX
+#define ART_SIMD_MAX 2
+#endif
 
-static const int8_t COUNT_NODES = 0;
-static const int8_t CHILDREN_NODES = 1;
+static const int8_t NODE4_SIZE = 4;
+static const int8_t NODE48_SIZE = 48;
 
 
 // Shared header of all inner nodes
 struct Node {
    // length of the compressed path (prefix)
    uint32_t prefixLength;
+   // version for optimistic lock coupling (bit 0: obsolete, bit 1:
+   // locked), only used by the OLC operations
+   std::atomic<uint32_t> version;
    // number of non-null children
    uint16_t count;
    // node type
    int8_t type;
+   // set on classic nodes a bulk load built where a NodeLinear would have
+   // split the keys worse
+   bool fallback;
    // compressed path (prefix)
    uint8_t prefix[maxPrefixLength];
 
-   Node(int8_t type) : prefixLength(0),count(0),type(type) {}
+   Node(int8_t type) : prefixLength(0),version(0),count(0),type(type),fallback(false) {}
 };
 
+inline unsigned matchPrefix(const Node* node,const uint8_t key[],unsigned depth,unsigned limit) {
+   // Number of leading bytes of the stored prefix (the first
+   // min(prefixLength,maxPrefixLength) bytes) equal to key[depth..], where
+   // key holds limit bytes. Compares 8 bytes at a time with XOR and ctz;
+   // the last word only loads the bytes left in prefix, the bytes past
+   // length are masked out.
+   unsigned length=std::min(node->prefixLength,maxPrefixLength);
+   for (unsigned pos=0;pos<length;pos+=8) {
+      unsigned offset=depth+pos;
+      if (offset>=limit)
+         return pos;
+      uint64_t a=0,b=0;
+      if (maxPrefixLength-pos>=8)
+         memcpy(&a,node->prefix+pos,8);
+      else
+         memcpy(&a,node->prefix+pos,maxPrefixLength-pos);
+      if (limit>=8) {
+         // Load the 8-byte window ending at the key end at the latest
+         unsigned start=std::min(offset,limit-8);
+         memcpy(&b,key+start,8);
+         b>>=8*(offset-start);
+      } else
+         memcpy(&b,key+offset,limit-offset);
+      uint64_t diff=a^b;
+      if (length-pos<8)
+         diff&=(1ull<<(8*(length-pos)))-1;
+      if (diff)
+         return pos+(__builtin_ctzll(diff)>>3);
+   }
+   return length;
+}
+
+// The classic node types are cache-line aligned, so the header and the
+// keys (or the start of childIndex) share the first line of the node. A
+// Node4 fits into that line completely.
+
 // Node with up to 4 children
-struct Node4 : Node {
+struct alignas(64) Node4 : Node {
+   static const int8_t nodeType=NodeType4;
    uint8_t key[NODE4_SIZE];
    Node* child[NODE4_SIZE];
 
@@ -52,7 +124,8 @@ struct Node4 : Node {
 };
 
 // Node with up to 16 children
-struct Node16 : Node {
+struct alignas(64) Node16 : Node {
+   static const int8_t nodeType=NodeType16;
    uint8_t key[16];
    Node* child[16];
 
@@ -62,22 +135,112 @@ struct Node16 : Node {
    }
 };
 
-static const int8_t LINEAR_SIZE=32;
-struct NodeLinear : Node {
-   Node* child[LINEAR_SIZE];
-   double a=0.0, b=0.0;
+// Linear nodes choose their fanout when they are built, a power of two in
+// [LINEAR_MIN_FANOUT,LINEAR_MAX_FANOUT]; models over one key byte have at
+// most 256 buckets
+static const unsigned LINEAR_MIN_FANOUT=16;
+static const unsigned LINEAR_MAX_FANOUT=4096;
+static const unsigned LINEAR_FANOUT_CLASSES=9;
+// Models read up to this many key bytes at once
+static const unsigned LINEAR_MAX_KEY_BYTES=4;
+// Fractional bits of the fixed-point model over one key byte, models over
+// more bytes choose their own
+static const unsigned LINEAR_MODEL_SHIFT=16;
 
-   NodeLinear() : Node(NodeTypeLinear) {
-      memset(child,0,sizeof(child));
-   }
+// The model and the counters share the first cache line with the header,
+// the bucket slots follow directly: Node* child[fanout], then uint32_t
+// occupancy[fanout] (linearChildren and linearOccupancy)
+struct alignas(64) NodeLinear : Node {
+   static const int8_t nodeType=NodeTypeLinear;
+   // bucket=(slope*x+intercept)>>shift, clamped to the bucket range, where
+   // x are the keyBytes key bytes at the node's depth read big endian;
+   // setLinearModel bounds slope and intercept so the expression never
+   // overflows 64 bits (32 bits for one-byte models)
+   int64_t intercept=0;
+   int32_t slope=0;
+   uint8_t shift=LINEAR_MODEL_SHIFT, keyBytes=1;
+   uint16_t fanout;
+   // number of keys in the subtree, now and when the model was fit
+   uint32_t size=0, trained=0;
+   // inserts since the fit whose prediction fell outside the buckets
+   uint32_t misses=0;
+   // root mean square distance in buckets of the fit from the key ranks
+   float fitError=0;
+
+   NodeLinear(unsigned fanout);
 };
 
+inline Node** linearChildren(NodeLinear* node) {
+   return reinterpret_cast<Node**>(node+1);
+}
+
+inline Node* const* linearChildren(const NodeLinear* node) {
+   return reinterpret_cast<Node* const*>(node+1);
+}
+
+inline uint32_t* linearOccupancy(NodeLinear* node) {
+   // Number of keys below each bucket, only used by inserts and erases
+   return reinterpret_cast<uint32_t*>(linearChildren(node)+node->fanout);
+}
+
+inline size_t linearNodeSize(unsigned fanout) {
+   return sizeof(NodeLinear)+fanout*(sizeof(Node*)+sizeof(uint32_t));
+}
+
+inline NodeLinear::NodeLinear(unsigned fanout) : Node(NodeTypeLinear),fanout(fanout) {
+   memset(linearChildren(this),0,fanout*(sizeof(Node*)+sizeof(uint32_t)));
+}
+
+inline uint32_t linearKey(const NodeLinear* node,const uint8_t key[]) {
+   // The keyBytes bytes at key as one big-endian integer
+   switch (node->keyBytes) {
+      case 1: return key[0];
+      case 2: return (key[0]<<8)|key[1];
+      case 3: return (key[0]<<16)|(key[1]<<8)|key[2];
+      default: return (static_cast<uint32_t>(key[0])<<24)|(key[1]<<16)|(key[2]<<8)|key[3];
+   }
+}
+
+inline int64_t linearPrediction(const NodeLinear* node,const uint8_t key[]) {
+   // Unclamped bucket prediction of the model for the key bytes at key
+   return (static_cast<int64_t>(node->slope)*linearKey(node,key)+node->intercept)>>node->shift;
+}
+
+inline unsigned linearBucket(const NodeLinear* node,const uint8_t key[]) {
+   // Bucket for the key bytes at key, the clamp compiles to conditional moves
+   return std::min<int64_t>(std::max<int64_t>(linearPrediction(node,key),0),node->fanout-1);
+}
+
+// Adaptive linear nodes: an insert into a bucket holding more than
+// LINEAR_OVERLOAD times its share of keys rebuilds that bucket as a learned
+// subtree (split), a node that doubled since its model was fit is retrained
+// together with its subtree. Both are amortized over the inserts that caused
+// them. Retraining is limited to subtrees of at most LINEAR_RETRAIN_MAX keys,
+// larger nodes only split buckets.
+static const unsigned LINEAR_OVERLOAD=4;
+static const unsigned LINEAR_REBUILD_MIN=64;
+static const unsigned LINEAR_RETRAIN_MAX=1<<20;
+
+
+
+// Node with up to 32 children, searched like a Node16 with 32-byte
+// compares
+struct alignas(64) Node32 : Node {
+   static const int8_t nodeType=NodeType32;
+   uint8_t key[32];
+   Node* child[32];
 
+   Node32() : Node(NodeType32) {
+      memset(key,0,sizeof(key));
+      memset(child,0,sizeof(child));
+   }
+};
 
 static const uint8_t emptyMarker=NODE48_SIZE;
 
 // Node with up to 48 children
-struct Node48 : Node {
+struct alignas(64) Node48 : Node {
+   static const int8_t nodeType=NodeType48;
    uint8_t childIndex[256];
    Node* child[NODE48_SIZE];
 
@@ -88,7 +251,8 @@ struct Node48 : Node {
 };
 
 // Node with up to 256 children
-struct Node256 : Node {
+struct alignas(64) Node256 : Node {
+   static const int8_t nodeType=NodeType256;
    Node* child[256];
 
    Node256() : Node(NodeType256) {
@@ -96,9 +260,335 @@ struct Node256 : Node {
    }
 };
 
+// Pages are carved into fixed-size node slots
+static const size_t ARENA_PAGE_SIZE=1<<18;
+
+// Slots for the nodes of one type; freed slots form a free list (linked
+// through their first word), pages are linked through their first cache
+// line, which also names the pool
+struct NodePool {
+   size_t slotSize=0;
+   void* freeList=NULL;
+   uint8_t* bump=NULL;
+   uint8_t* end=NULL;
+   void* pages=NULL;
+   size_t pageCount=0;
+   std::atomic_flag lock=ATOMIC_FLAG_INIT;
+};
+
+// Pools of the arena: one per node type, except that linear nodes take
+// the pool NodeTypeCount+c for fanout LINEAR_MIN_FANOUT<<c
+static const unsigned ARENA_POOLS=NodeTypeCount+LINEAR_FANOUT_CLASSES;
+
+// NUMA placement of the pages of an arena: the node to bind them to, or
+// one of these
+static const int ARENA_NUMA_ANY=-1;        // first touch (the default)
+static const int ARENA_NUMA_INTERLEAVE=-2; // page by page over all nodes
+
+// Slab allocator with one pool per node type (and linear fanout). Nodes
+// freed by grow/shrink go back to the arena that allocated them and are
+// reused by its next node of the same type; releasing the arena drops all
+// nodes allocated from it in O(pages).
+// -DART_MALLOC_NODES takes every node from the heap instead (for
+// comparisons), arenas then only keep track of their nodes.
+struct Arena {
+   NodePool pools[ARENA_POOLS];
+   int numaNode;
+
+   Arena(int numaNode=ARENA_NUMA_ANY);
+   ~Arena();
+};
+
+// Leaf records. A leaf stores a tuple identifier, its key is whatever the
+// key loader makes of it. To keep the full key and an 8-byte payload (a
+// row location, say) with the leaf, the identifier can instead be the
+// address of a LeafRecord, with loadKeyRecord as key loader and
+// RecordLoader<KeyLen> for the fixed-width operations. Leaf checks then read
+// the record instead of the database, and 8-byte keys keep all of their
+// bits. Records are allocated from a LeafArena and live until freeRecord or
+// the end of the arena; erase does not free them. Trees with record leaves
+// cannot be serialized, serializeTree fails while loadKeyRecord is the key
+// loader.
+struct LeafRecord {
+   uint64_t payload;
+   // the key bytes follow the header
+   uint32_t keyLength;
+};
+
+// Slots for the records of keys of up to maxKeyLength bytes
+struct LeafArena {
+   NodePool pool;
+   unsigned maxKeyLength;
+
+   LeafArena(unsigned maxKeyLength);
+   ~LeafArena();
+};
+
+// Memory used by the inner nodes of a tree, per node type
+struct MemoryUsage {
+   size_t nodes[NodeTypeCount];
+   size_t bytes[NodeTypeCount];
+   size_t total;
+};
+
+// Levels and prefix lengths past the last histogram bucket are counted in it
+static const unsigned STATS_MAX_LEVEL=32;
+static const unsigned STATS_MAX_PREFIX=16;
+static const unsigned STATS_SKEW_BUCKETS=16;
+
+// Shape of a tree, gathered in a single pass by collectStats. Levels count
+// hops from the root, the root is at level 0.
+struct TreeStats {
+   size_t nodes[NodeTypeCount];
+   // bytes of the nodes, per node type
+   size_t bytes[NodeTypeCount];
+   // non-empty child slots, per node type
+   size_t children[NodeTypeCount];
+   size_t leaves;
+   // number of levels holding nodes or leaves
+   unsigned height;
+   size_t levelNodes[STATS_MAX_LEVEL][NodeTypeCount];
+   size_t leafLevel[STATS_MAX_LEVEL];
+   // nodes per type by number of non-empty child slots (256 or more are
+   // counted at 256)
+   size_t fanout[NodeTypeCount][257];
+   // inner nodes by length of the compressed path
+   size_t prefixLength[STATS_MAX_PREFIX+1];
+   // NodeLinear skew: keys in the fullest bucket relative to an even spread
+   // over all buckets (1 is perfect), histogram of its integer part
+   size_t linearSkew[STATS_SKEW_BUCKETS];
+   double linearSkewMean, linearSkewMax;
+   size_t linearEmptyBuckets;
+   size_t linearMisses;
+   // NodeLinear fit error (see NodeLinear::fitError)
+   double linearFitErrorMean, linearFitErrorMax;
+   // classic nodes built instead of a NodeLinear, per node type
+   size_t linearFallback[NodeTypeCount];
+   // NodeLinear shapes: nodes by fanout class and by model key bytes
+   size_t linearFanout[LINEAR_FANOUT_CLASSES];
+   size_t linearKeyBytes[LINEAR_MAX_KEY_BYTES+1];
+   // keys of subtrees not yet built by a lazy bulk load
+   size_t lazyKeys;
+};
+
+Arena* getArena();
+Arena* setArena(Arena*);
+void releaseArena(Arena*);
+void* arenaAlloc(unsigned);
+void freeNode(Node*);
+LeafRecord* allocRecord(LeafArena&, const uint8_t*, unsigned, uint64_t);
+void freeRecord(LeafArena&, LeafRecord*);
+size_t arenaMemory(Arena*);
+void destroy(Node*);
+MemoryUsage memoryUsage(Node*);
+void collectStats(Node*, TreeStats&);
+void printStatsJSON(const TreeStats&, FILE*);
+void printStatsCSV(const TreeStats&, FILE*);
+void profile(Node*, FILE*);
+
+template<class T> T* allocNode() {
+   // New node from the pool of its type in the current arena
+   return new (arenaAlloc(T::nodeType)) T();
+}
+
+inline unsigned linearFanoutClass(unsigned fanout) {
+   return __builtin_ctz(fanout)-__builtin_ctz(LINEAR_MIN_FANOUT);
+}
+
+inline NodeLinear* allocLinear(unsigned fanout) {
+   // New linear node with fanout buckets, a power of two in range
+   return new (arenaAlloc(NodeTypeCount+linearFanoutClass(fanout))) NodeLinear(fanout);
+}
+
+// Cursor for ordered scans: the path from the root to the current leaf,
+// each frame holds a node and the child slot taken in it
+struct IteratorFrame {
+   Node* node;
+   int pos;
+};
+
+struct Iterator {
+   std::vector<IteratorFrame> stack;
+   // current leaf, NULL once the iterator ran off either end
+   Node* leaf=NULL;
+};
+
+// Path of the previous insertWithHint, one frame per child slot taken from
+// the root down
+struct InsertHintFrame {
+   Node** ref;
+   // node in the slot when it was passed
+   Node* node;
+   // number of leading key bytes that selected the slot, depth of its node
+   unsigned routed, depth;
+};
+
+// Inserts with the same hint resume at the deepest node the new key shares
+// with the previous one, which makes sorted appends cheap. Clear the path
+// after modifying the tree other than through insertWithHint with this hint.
+struct InsertHint {
+   std::vector<InsertHintFrame> path;
+   std::vector<uint8_t> key;
+};
+
+// Tree shared by concurrent readers and writers (optimistic lock
+// coupling). The version word guards the root slot the way a node version
+// guards its child slots.
+struct ConcurrentTree {
+   std::atomic<uint32_t> version;
+   Node* root;
+
+   ConcurrentTree() : version(0),root(NULL) {}
+};
+
+// Pins the current epoch for the lifetime of the guard: nodes retired
+// meanwhile are not freed until it is gone. Guards nest.
+struct EpochGuard {
+   EpochGuard();
+   ~EpochGuard();
+};
+
+// Read-copy-update snapshots of bulk-loaded trees. A rebuild loads the new
+// tree into an arena of its own and publishes it with one atomic swap of the
+// root; the previous tree and its arena are dropped once the readers that
+// might still use it drained. Readers hold an EpochGuard and run the plain
+// single-threaded operations on snapshotRoot, without further
+// synchronization. Rebuilds of one tree are serialized.
+//
+// With replicaLevels set (before the first publishSnapshot), every rebuild
+// also copies the top replicaLevels levels of the tree into an arena bound
+// to each NUMA node, and places the rest of the tree interleaved over all
+// nodes. snapshotRoot then returns the replica of the caller's node; the
+// replicas are published with one swap of the replica array.
+struct SnapshotTree {
+   std::atomic<Node*> root;
+   Arena* arena;
+   unsigned replicaLevels;
+   // one root per NUMA node, NULL without replicas
+   std::atomic<Node**> replicas;
+   std::vector<Arena*> replicaArenas;
+   std::mutex rebuild;
+
+   SnapshotTree() : root(NULL),arena(NULL),replicaLevels(0),replicas(NULL) {}
+   ~SnapshotTree();
+};
+
+unsigned numaNodeCount();
+unsigned numaNodeOfThread();
+
+inline Node* snapshotRoot(SnapshotTree& tree) {
+   // Root of the current snapshot, valid until the EpochGuard of the caller
+   // ends; the replica of the caller's NUMA node if there are replicas
+   Node** replicas=tree.replicas.load();
+   return replicas?replicas[numaNodeOfThread()]:tree.root.load();
+}
+
+// Serialized trees. serializeTree writes the nodes in their memory layout,
+// breadth-first, with child pointers replaced by byte offsets from the start
+// of the file; leaves keep their makeLeaf encoding and 0 is no child.
+// mapTree maps such an image read-only and lookupMapped searches it in
+// place, so opening a tree costs only the page faults of the nodes touched.
+// Keys are loaded by the key loader as usual. An image is only accepted by
+// builds with the same node layout and maxPrefixLength, and if its header
+// matches the file; lookupMapped checks every node it reaches against the
+// mapping, so a corrupt image fails lookups instead of crashing them.
+struct MappedTree {
+   const uint8_t* base;
+   size_t size;
+   Node* root;
+
+   MappedTree() : base(NULL),size(0),root(NULL) {}
+};
+
+#ifdef ART_VISIT_COUNTERS
+// Inner nodes passed by lookup and lookupBatch on this thread, per node type
+extern thread_local uint64_t lookupVisits[NodeTypeCount];
+#define COUNT_VISIT(type) (lookupVisits[type]++)
+#else
+#define COUNT_VISIT(type) ((void)0)
+#endif
+
+// Leaves store a tuple identifier, the key of a leaf is produced by the key
+// loader of the thread (the identifier itself, big endian, by default).
+// Keys of variable length end with a terminator byte that occurs nowhere
+// else in a key (0 for C strings and ICU sort keys), so no key is a prefix
+// of another; key lengths passed to the operations include it, and
+// maxKeyLength bounds every key of the tree. A loader must write the whole
+// key including the terminator.
+typedef void (*KeyLoader)(uintptr_t, uint8_t*);
+
+KeyLoader getKeyLoader();
+KeyLoader setKeyLoader(KeyLoader);
+void loadKeyUInt64(uintptr_t, uint8_t*);
+void loadKeyRecord(uintptr_t, uint8_t*);
+#ifdef ART_ICU
+unsigned collationKey(const UCollator*, const UChar*, int32_t, uint8_t*, unsigned);
+unsigned collationKeyUTF8(const UCollator*, const char*, int32_t, uint8_t*, unsigned);
+#endif
+
 void insert(Node*, Node**, uint8_t*, unsigned, uintptr_t, unsigned);
+void insertWithHint(Node**, uint8_t*, uintptr_t, unsigned, InsertHint&);
+// Sorted batch of distinct keys, existing keys get the batch's leaf
+void mergeBatch(Node**, const uint64_t*, size_t, unsigned);
 void loadKey(uintptr_t, uint8_t*);
 Node* lookup(Node*, uint8_t*, unsigned, unsigned, unsigned);
+// 8-byte keys only, the probes are given by value
+void lookupBatch(Node*, const uint64_t*, size_t, Node**);
+bool seekMinimum(Node*, Iterator&);
+bool seekMaximum(Node*, Iterator&);
+bool lowerBound(Node*, uint8_t*, unsigned, unsigned, Iterator&);
+bool upperBound(Node*, uint8_t*, unsigned, unsigned, Iterator&);
+bool next(Iterator&);
+bool prev(Iterator&);
+Node* lookupOLC(ConcurrentTree&, uint8_t*, unsigned, unsigned);
+void insertOLC(ConcurrentTree&, uint8_t*, uintptr_t, unsigned);
+void retireNode(Node*);
+void synchronizeEpochs();
+void publishSnapshot(SnapshotTree&, uint64_t*, size_t, unsigned, unsigned);
+bool serializeTree(Node*, const char*);
+bool mapTree(const char*, MappedTree&);
+void unmapTree(MappedTree&);
+Node* lookupMapped(const MappedTree&, uint8_t*, unsigned, unsigned);
+// Bulk loads of at most INT32_MAX sorted keys
+void insertBulk(Node*, Node**, uint64_t*, int, unsigned, unsigned);
+void insertBulkParallel(Node**, uint64_t*, size_t, unsigned, unsigned);
+void insertBulkLazy(Node**, uint64_t*, size_t, unsigned);
+
+// Streaming bulk loads of sorted keys that need not fit into memory. A
+// reader is called with its context, a buffer and the room in it; it
+// writes the next keys in order and returns how many, 0 at the end.
+// Duplicates are dropped. The root is fit on a sorted sample of the n
+// keys, which must hold the first and the last key. Memory holds the tree
+// plus one chunk of keys. insertBulkFile stores the number of keys it read
+// from the file.
+typedef size_t (*KeyReader)(void*, uint64_t*, size_t);
+void insertBulkStream(Node**, KeyReader, void*, uint64_t, const uint64_t*, size_t, unsigned);
+bool insertBulkFile(Node**, const char*, unsigned, uint64_t*);
+void materializeTree(Node**);
+void setLinearModel(NodeLinear*, double, double);
+void predictBatch(const NodeLinear*, const uint8_t*, unsigned, uint8_t*);
+
+// Lazy bulk loading. insertBulkLazy trains the root NodeLinear right away
+// and keeps each larger bucket as a NodeLazy: a reference to its sub-range
+// of the key array. The subtree of a bucket is built, again one level at a
+// time, by the first operation that reaches it (lookups included), so cold
+// key ranges cost no memory. The key array must be sorted by key and stay
+// valid and unmodified until materializeTree or destroy; building keeps the
+// sub-ranges sorted. Lazy trees are single-threaded (no OLC operations),
+// serializeTree rejects them until materializeTree built everything.
+struct NodeLazy : Node {
+   static const int8_t nodeType=NodeTypeLazy;
+   uint64_t* keys;
+   uint32_t size;
+   // depth and key length of the bulk load, and its key loader
+   uint32_t depth, maxKeyLength;
+   KeyLoader loader;
+
+   NodeLazy() : Node(NodeTypeLazy),keys(NULL),size(0),depth(0),maxKeyLength(0),loader(NULL) {}
+};
+
+Node* materializeLazy(Node**);
+
 inline uintptr_t getLeafValue(Node* node) {
    // The the value stored in the pseudo-leaf
    return reinterpret_cast<uintptr_t>(node)>>1;
@@ -107,4 +597,338 @@ inline uintptr_t getLeafValue(Node* node) {
 inline bool isLeaf(Node* node) {
    // Is the node a leaf?
    return reinterpret_cast<uintptr_t>(node)&1;
-}
\ No newline at end of file
+}
+
+inline Node* makeLeaf(uintptr_t tid) {
+   // Create a pseudo-leaf
+   return reinterpret_cast<Node*>((tid<<1)|1);
+}
+
+inline uint8_t* recordKey(LeafRecord* record) {
+   return reinterpret_cast<uint8_t*>(record+1);
+}
+
+inline const uint8_t* recordKey(const LeafRecord* record) {
+   return reinterpret_cast<const uint8_t*>(record+1);
+}
+
+inline Node* makeRecordLeaf(LeafRecord* record) {
+   // Leaf whose tuple identifier is the record
+   return makeLeaf(reinterpret_cast<uintptr_t>(record));
+}
+
+inline LeafRecord* leafRecord(Node* leaf) {
+   // Record of a leaf made with makeRecordLeaf
+   return reinterpret_cast<LeafRecord*>(getLeafValue(leaf));
+}
+
+inline uint8_t flipSign(uint8_t keyByte) {
+   // Flip the sign bit, enables signed SSE comparison of unsigned values, used by Node16 and Node32
+   return keyByte^128;
+}
+
+inline uint32_t equalMask32(const uint8_t key[32],uint8_t keyByte) {
+   // Bit i is set if key[i]==keyByte; one AVX2 compare where the build
+   // targets it, two SSE2 compares otherwise
+#if defined(__AVX2__)&&ART_SIMD_MAX>=1
+   __m256i cmp=_mm256_cmpeq_epi8(_mm256_set1_epi8(keyByte),_mm256_loadu_si256(reinterpret_cast<const __m256i*>(key)));
+   return _mm256_movemask_epi8(cmp);
+#else
+   __m128i byte=_mm_set1_epi8(keyByte);
+   uint32_t low=_mm_movemask_epi8(_mm_cmpeq_epi8(byte,_mm_loadu_si128(reinterpret_cast<const __m128i*>(key))));
+   uint32_t high=_mm_movemask_epi8(_mm_cmpeq_epi8(byte,_mm_loadu_si128(reinterpret_cast<const __m128i*>(key+16))));
+   return low|(high<<16);
+#endif
+}
+
+inline uint32_t lessMask32(const uint8_t key[32],uint8_t keyByte) {
+   // Bit i is set if keyByte<key[i] as signed bytes (keys stored flipped)
+#if defined(__AVX2__)&&ART_SIMD_MAX>=1
+   __m256i cmp=_mm256_cmpgt_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(key)),_mm256_set1_epi8(keyByte));
+   return _mm256_movemask_epi8(cmp);
+#else
+   __m128i byte=_mm_set1_epi8(keyByte);
+   uint32_t low=_mm_movemask_epi8(_mm_cmplt_epi8(byte,_mm_loadu_si128(reinterpret_cast<const __m128i*>(key))));
+   uint32_t high=_mm_movemask_epi8(_mm_cmplt_epi8(byte,_mm_loadu_si128(reinterpret_cast<const __m128i*>(key+16))));
+   return low|(high<<16);
+#endif
+}
+
+static inline unsigned ctz(uint16_t x) {
+   // Count trailing zeros, only defined for x>0
+#ifdef __GNUC__
+   return __builtin_ctz(x);
+#else
+   // Adapted from Hacker's Delight
+   unsigned n=1;
+   if ((x&0xFF)==0) {n+=8; x=x>>8;}
+   if ((x&0x0F)==0) {n+=4; x=x>>4;}
+   if ((x&0x03)==0) {n+=2; x=x>>2;}
+   return n-(x&1);
+#endif
+}
+
+// This address is used to communicate that search failed
+extern Node* nullNode;
+
+inline Node* loadLazy(Node** slot) {
+   // The child in slot, built first if it is a pending lazy subtree
+   Node* child=*slot;
+   if (child&&!isLeaf(child)&&child->type==NodeTypeLazy)
+      return materializeLazy(slot);
+   return child;
+}
+
+inline Node** findChildByte(Node* n,uint8_t keyByte) {
+   // Child slot of a classic node for keyByte, &nullNode if there is none
+   switch (n->type) {
+      case NodeType4: {
+         // All four keys in one compare, slots past count are masked
+         Node4* node=static_cast<Node4*>(n);
+         int keys;
+         memcpy(&keys,node->key,NODE4_SIZE);
+         __m128i cmp=_mm_cmpeq_epi8(_mm_set1_epi8(keyByte),_mm_cvtsi32_si128(keys));
+         unsigned bitfield=_mm_movemask_epi8(cmp)&((1<<node->count)-1);
+         if (bitfield)
+            return &node->child[ctz(bitfield)]; else
+            return &nullNode;
+      }
+      case NodeType16: {
+         Node16* node=static_cast<Node16*>(n);
+         __m128i cmp=_mm_cmpeq_epi8(_mm_set1_epi8(flipSign(keyByte)),_mm_loadu_si128(reinterpret_cast<__m128i*>(node->key)));
+         unsigned bitfield=_mm_movemask_epi8(cmp)&((1<<node->count)-1);
+         if (bitfield)
+            return &node->child[ctz(bitfield)]; else
+            return &nullNode;
+      }
+      case NodeType32: {
+         Node32* node=static_cast<Node32*>(n);
+         uint32_t bitfield=equalMask32(node->key,flipSign(keyByte))&static_cast<uint32_t>((1ull<<node->count)-1);
+         if (bitfield)
+            return &node->child[__builtin_ctz(bitfield)]; else
+            return &nullNode;
+      }
+      case NodeType48: {
+         Node48* node=static_cast<Node48*>(n);
+         if (node->childIndex[keyByte]!=emptyMarker)
+            return &node->child[node->childIndex[keyByte]]; else
+            return &nullNode;
+      }
+      case NodeType256: {
+         Node256* node=static_cast<Node256*>(n);
+         return &(node->child[keyByte]);
+      }
+   }
+   throw; // Unreachable
+}
+
+inline Node** findChild(Node* n,const uint8_t key[]) {
+   // Find the next child for the key bytes at key, all but linear nodes
+   // only use the first
+   if (n->type==NodeTypeLinear) {
+      NodeLinear* node=static_cast<NodeLinear*>(n);
+      return &linearChildren(node)[linearBucket(node,key)];
+   }
+   return findChildByte(n,key[0]);
+}
+
+// Building blocks shared by the generic and the fixed-width operations
+Node4* joinLeaves(Node*, uint8_t*, uint8_t*, unsigned, uintptr_t);
+Node4* splitPrefix(Node*, uint8_t*, unsigned, unsigned, uintptr_t, unsigned);
+void insertNode4(Node4*, Node**, uint8_t, Node*);
+void insertNode16(Node16*, Node**, uint8_t, Node*);
+void insertNode32(Node32*, Node**, uint8_t, Node*);
+void insertNode48(Node48*, Node**, uint8_t, Node*);
+void insertNode256(Node256*, Node**, uint8_t, Node*);
+void insertNodeLinear(NodeLinear*, Node**, uint8_t*, Node*);
+bool adaptNodeLinear(NodeLinear*, Node**, Node**, uint8_t*, unsigned, unsigned);
+bool erase(Node*, Node**, uint8_t*, unsigned, unsigned, unsigned);
+void eraseNode4(Node4*, Node**, Node**);
+void eraseNode16(Node16*, Node**, Node**);
+void eraseNode32(Node32*, Node**, Node**);
+void eraseNode48(Node48*, Node**, uint8_t);
+void eraseNode256(Node256*, Node**, uint8_t);
+void eraseNodeLinear(NodeLinear*, Node**, Node**);
+
+// Fixed-width operations: lookup<KeyLen,Loader>, insert<KeyLen,Loader> and
+// erase<KeyLen,Loader> behave like the generic functions for keys of
+// exactly KeyLen bytes. Loader::load(tid,key) writes the key of a leaf.
+// Prefix comparisons use a key window of constant width, leaves are
+// verified with one compare of the whole key, and no key buffer is sized at
+// run time. Prefixes longer than maxPrefixLength (only possible for
+// KeyLen>maxPrefixLength) and the retraining of linear nodes fall back to
+// the generic code with Loader installed as key loader.
+
+struct UInt64Loader {
+   // The tuple identifier is the 8-byte key, as loadKeyUInt64
+   static void load(uintptr_t tid,uint8_t key[]) {
+      uint64_t k=__builtin_bswap64(tid);
+      memcpy(key,&k,8);
+   }
+};
+
+struct UInt32Loader {
+   // The low 32 bits of the tuple identifier are the 4-byte key
+   static void load(uintptr_t tid,uint8_t key[]) {
+      uint32_t k=__builtin_bswap32(static_cast<uint32_t>(tid));
+      memcpy(key,&k,4);
+   }
+};
+
+template<unsigned KeyLen>
+struct RecordLoader {
+   // The tuple identifier is a LeafRecord with a KeyLen-byte key, as
+   // loadKeyRecord; leafEquals becomes one compare against the record
+   static void load(uintptr_t tid,uint8_t key[]) {
+      memcpy(key,recordKey(reinterpret_cast<const LeafRecord*>(tid)),KeyLen);
+   }
+};
+
+template<unsigned KeyLen,class Loader>
+inline bool leafEquals(Node* leaf,uint8_t key[]) {
+   // Compare the whole key of the leaf, a single compare for 4 and 8 bytes
+   uint8_t leafKey[KeyLen];
+   Loader::load(getLeafValue(leaf),leafKey);
+   return memcmp(leafKey,key,KeyLen)==0;
+}
+
+template<unsigned KeyLen>
+inline unsigned prefixMismatchFixed(Node* node,uint8_t key[],unsigned depth) {
+   // Number of prefix bytes matching the key, for a prefix stored in full.
+   // With KeyLen constant the key window load needs no length checks.
+   return matchPrefix(node,key,depth,KeyLen);
+}
+
+template<unsigned KeyLen,class Loader>
+Node* lookup(Node* node,uint8_t key[]) {
+   // Find the leaf with the key
+   unsigned depth=0;
+   while (node!=NULL) {
+      if (isLeaf(node))
+         return leafEquals<KeyLen,Loader>(node,key)?node:NULL;
+      if (node->prefixLength) {
+         // The stored part only, leafEquals checks the whole key
+         if (prefixMismatchFixed<KeyLen>(node,key,depth)<std::min(node->prefixLength,maxPrefixLength))
+            return NULL;
+         depth+=node->prefixLength;
+      }
+      unsigned type=node->type;
+      COUNT_VISIT(type);
+      node=loadLazy(findChild(node,key+depth));
+      if (type!=NodeTypeLinear)
+         depth++;
+   }
+   return NULL;
+}
+
+template<unsigned KeyLen,class Loader>
+void insertFixed(Node* node,Node** nodeRef,uint8_t key[],unsigned depth,uintptr_t value) {
+   // insert<KeyLen,Loader> below depth
+   if (node==NULL) {
+      *nodeRef=makeLeaf(value);
+      return;
+   }
+
+   if (isLeaf(node)) {
+      uint8_t existingKey[KeyLen];
+      Loader::load(getLeafValue(node),existingKey);
+      *nodeRef=joinLeaves(node,existingKey,key,depth,value);
+      return;
+   }
+
+   if (node->prefixLength) {
+      if (node->prefixLength>=maxPrefixLength) {
+         KeyLoader previous=setKeyLoader(Loader::load);
+         insert(node,nodeRef,key,depth,value,KeyLen);
+         setKeyLoader(previous);
+         return;
+      }
+      unsigned mismatchPos=prefixMismatchFixed<KeyLen>(node,key,depth);
+      if (mismatchPos!=node->prefixLength) {
+         *nodeRef=splitPrefix(node,key,depth,mismatchPos,value,KeyLen);
+         return;
+      }
+      depth+=node->prefixLength;
+   }
+
+   Node** child=findChild(node,key+depth);
+   if (loadLazy(child)) {
+      insertFixed<KeyLen,Loader>(*child,child,key,depth+(node->type!=NodeTypeLinear),value);
+   } else {
+      Node* newNode=makeLeaf(value);
+      switch (node->type) {
+         case NodeType4: insertNode4(static_cast<Node4*>(node),nodeRef,key[depth],newNode); return;
+         case NodeType16: insertNode16(static_cast<Node16*>(node),nodeRef,key[depth],newNode); return;
+         case NodeType32: insertNode32(static_cast<Node32*>(node),nodeRef,key[depth],newNode); return;
+         case NodeType48: insertNode48(static_cast<Node48*>(node),nodeRef,key[depth],newNode); return;
+         case NodeType256: insertNode256(static_cast<Node256*>(node),nodeRef,key[depth],newNode); return;
+         case NodeTypeLinear: insertNodeLinear(static_cast<NodeLinear*>(node),nodeRef,key+depth,newNode); break;
+      }
+   }
+   if (node->type==NodeTypeLinear) {
+      KeyLoader previous=setKeyLoader(Loader::load);
+      adaptNodeLinear(static_cast<NodeLinear*>(node),nodeRef,child,key+depth,depth,KeyLen);
+      setKeyLoader(previous);
+   }
+}
+
+template<unsigned KeyLen,class Loader>
+void insert(Node* node,Node** nodeRef,uint8_t key[],uintptr_t value) {
+   // Insert the leaf value into the tree
+   insertFixed<KeyLen,Loader>(node,nodeRef,key,0,value);
+}
+
+template<unsigned KeyLen,class Loader>
+bool eraseFixed(Node* node,Node** nodeRef,uint8_t key[],unsigned depth) {
+   // erase<KeyLen,Loader> below depth
+   if (!node)
+      return false;
+
+   if (isLeaf(node)) {
+      if (!leafEquals<KeyLen,Loader>(node,key))
+         return false;
+      *nodeRef=NULL;
+      return true;
+   }
+
+   if (node->prefixLength) {
+      if (node->prefixLength>=maxPrefixLength) {
+         KeyLoader previous=setKeyLoader(Loader::load);
+         bool erased=erase(node,nodeRef,key,KeyLen,depth,KeyLen);
+         setKeyLoader(previous);
+         return erased;
+      }
+      if (prefixMismatchFixed<KeyLen>(node,key,depth)!=node->prefixLength)
+         return false;
+      depth+=node->prefixLength;
+   }
+
+   Node** child=findChild(node,key+depth);
+   loadLazy(child);
+   if (isLeaf(*child)&&leafEquals<KeyLen,Loader>(*child,key)) {
+      switch (node->type) {
+         case NodeType4: eraseNode4(static_cast<Node4*>(node),nodeRef,child); break;
+         case NodeType16: eraseNode16(static_cast<Node16*>(node),nodeRef,child); break;
+         case NodeType32: eraseNode32(static_cast<Node32*>(node),nodeRef,child); break;
+         case NodeType48: eraseNode48(static_cast<Node48*>(node),nodeRef,key[depth]); break;
+         case NodeType256: eraseNode256(static_cast<Node256*>(node),nodeRef,key[depth]); break;
+         case NodeTypeLinear: eraseNodeLinear(static_cast<NodeLinear*>(node),nodeRef,child); break;
+      }
+      return true;
+   }
+
+   if (!eraseFixed<KeyLen,Loader>(*child,child,key,depth+(node->type!=NodeTypeLinear)))
+      return false;
+   if (node->type==NodeTypeLinear) {
+      NodeLinear* n=static_cast<NodeLinear*>(node);
+      n->size--;
+      linearOccupancy(n)[child-linearChildren(n)]--;
+   }
+   return true;
+}
+
+template<unsigned KeyLen,class Loader>
+bool erase(Node* node,Node** nodeRef,uint8_t key[]) {
+   // Delete the leaf with the key, returns false if it was not found
+   return eraseFixed<KeyLen,Loader>(node,nodeRef,key,0);
+}
@@ -0,0 +1,864 @@
+/*
+  Benchmark of the Adaptive Radix Tree: build, lookup, scan, erase and
+  ingest phases over generated or SOSD key sets, one CSV row per phase
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <x86intrin.h> // __rdtsc
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <map>
+#include <string>
+#include <unistd.h>    // getpid, unlink
+#if defined(ART_PAPI)
+#include <papi.h>
+#elif defined(ART_PERF_COUNTERS)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#endif
+#include "ART.hpp"
+
+static double gettime(void) {
+  // Seconds on the monotonic clock
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Per-operation latencies are taken with the time stamp counter on at most
+// LATENCY_SAMPLES operations of each phase
+static const uint64_t LATENCY_SAMPLES=1<<20;
+// Skew of the Zipfian lookup order, as in YCSB
+static const double ZIPF_THETA=0.99;
+
+static double nsPerCycle=1;
+
+static inline uint64_t readCycles() {
+   // Time stamp counter, fenced so it does not move across the timed operation
+   _mm_lfence();
+   uint64_t cycles=__rdtsc();
+   _mm_lfence();
+   return cycles;
+}
+
+static void calibrateCycles() {
+   // Rate of the time stamp counter against the monotonic clock
+   double start=gettime();
+   uint64_t cycles=readCycles();
+   while (gettime()-start<0.05);
+   double seconds=gettime()-start;
+   nsPerCycle=seconds*1e9/(readCycles()-cycles);
+}
+
+// Optional instrumentation of the benchmark phases, selected at compile
+// time: -DART_PERF_COUNTERS counts hardware events with perf_event_open,
+// -DART_PAPI with PAPI instead; -DART_VISIT_COUNTERS counts the inner nodes
+// lookups pass per node type. Each adds per-operation columns to the report
+// for the span between startCounters and stopCounters.
+#if defined(ART_PERF_COUNTERS)||defined(ART_PAPI)
+#define ART_HW_COUNTERS
+static const int COUNTER_EVENTS=5;
+static const char* counterNames[COUNTER_EVENTS]={"instructions","branchMisses","l1dMisses","llcMisses","dtlbMisses"};
+// Events of the last phase, negative if the event is not available
+static double phaseCounters[COUNTER_EVENTS];
+#endif
+
+#if defined(ART_PAPI)
+static int papiEventSet=PAPI_NULL;
+// Position of each event in the PAPI event set, -1 if it could not be added
+static int papiSlot[COUNTER_EVENTS];
+
+static void openCounters() {
+   static const int events[COUNTER_EVENTS]={PAPI_TOT_INS,PAPI_BR_MSP,PAPI_L1_DCM,PAPI_L3_TCM,PAPI_TLB_DM};
+   for (int i=0;i<COUNTER_EVENTS;i++)
+      papiSlot[i]=-1;
+   if (PAPI_library_init(PAPI_VER_CURRENT)!=PAPI_VER_CURRENT||PAPI_create_eventset(&papiEventSet)!=PAPI_OK) {
+      fprintf(stderr,"PAPI not available, counters disabled\n");
+      papiEventSet=PAPI_NULL;
+      return;
+   }
+   int slots=0;
+   for (int i=0;i<COUNTER_EVENTS;i++)
+      if (PAPI_add_event(papiEventSet,events[i])==PAPI_OK)
+         papiSlot[i]=slots++;
+}
+
+static void startCounters() {
+   if (papiEventSet!=PAPI_NULL)
+      PAPI_start(papiEventSet);
+}
+
+static void stopCounters() {
+   long long values[COUNTER_EVENTS]={0};
+   if (papiEventSet!=PAPI_NULL)
+      PAPI_stop(papiEventSet,values);
+   for (int i=0;i<COUNTER_EVENTS;i++)
+      phaseCounters[i]=(papiEventSet!=PAPI_NULL&&papiSlot[i]>=0)?values[papiSlot[i]]:-1;
+}
+#elif defined(ART_PERF_COUNTERS)
+static int counterFds[COUNTER_EVENTS];
+
+static void openCounters() {
+   // One counter per event rather than a group, so a missing event does not
+   // disable the others; user space only, inherited by the bulk load workers
+   static const uint32_t types[COUNTER_EVENTS]={PERF_TYPE_HARDWARE,PERF_TYPE_HARDWARE,PERF_TYPE_HW_CACHE,PERF_TYPE_HW_CACHE,PERF_TYPE_HW_CACHE};
+   static const uint64_t readMiss=(PERF_COUNT_HW_CACHE_OP_READ<<8)|(PERF_COUNT_HW_CACHE_RESULT_MISS<<16);
+   static const uint64_t configs[COUNTER_EVENTS]={PERF_COUNT_HW_INSTRUCTIONS,PERF_COUNT_HW_BRANCH_MISSES,PERF_COUNT_HW_CACHE_L1D|readMiss,PERF_COUNT_HW_CACHE_LL|readMiss,PERF_COUNT_HW_CACHE_DTLB|readMiss};
+   for (int i=0;i<COUNTER_EVENTS;i++) {
+      struct perf_event_attr attr;
+      memset(&attr,0,sizeof(attr));
+      attr.size=sizeof(attr);
+      attr.type=types[i];
+      attr.config=configs[i];
+      attr.disabled=1;
+      attr.exclude_kernel=1;
+      attr.exclude_hv=1;
+      attr.inherit=1;
+      attr.read_format=PERF_FORMAT_TOTAL_TIME_ENABLED|PERF_FORMAT_TOTAL_TIME_RUNNING;
+      counterFds[i]=syscall(__NR_perf_event_open,&attr,0,-1,-1,0);
+      if (counterFds[i]<0)
+         fprintf(stderr,"perf_event_open failed for %s (%s), counter disabled\n",counterNames[i],strerror(errno));
+   }
+}
+
+static void startCounters() {
+   for (int i=0;i<COUNTER_EVENTS;i++)
+      if (counterFds[i]>=0) {
+         ioctl(counterFds[i],PERF_EVENT_IOC_RESET,0);
+         ioctl(counterFds[i],PERF_EVENT_IOC_ENABLE,0);
+      }
+}
+
+static void stopCounters() {
+   // Values are scaled up if the kernel multiplexed the counter
+   for (int i=0;i<COUNTER_EVENTS;i++) {
+      phaseCounters[i]=-1;
+      if (counterFds[i]<0)
+         continue;
+      ioctl(counterFds[i],PERF_EVENT_IOC_DISABLE,0);
+      uint64_t value[3];
+      if (read(counterFds[i],value,sizeof(value))==sizeof(value)&&value[2])
+         phaseCounters[i]=static_cast<double>(value[0])*value[1]/value[2];
+   }
+}
+#else
+static void openCounters() {}
+static void startCounters() {}
+static void stopCounters() {}
+#endif
+
+#ifdef ART_VISIT_COUNTERS
+static uint64_t visitsStart[NodeTypeCount];
+static uint64_t phaseVisits[NodeTypeCount];
+#endif
+
+static void beginPhase() {
+   // Start of the span reported by the next report
+#ifdef ART_VISIT_COUNTERS
+   memcpy(visitsStart,lookupVisits,sizeof(visitsStart));
+#endif
+   startCounters();
+}
+
+static void endPhase() {
+   stopCounters();
+#ifdef ART_VISIT_COUNTERS
+   for (int i=0;i<NodeTypeCount;i++)
+      phaseVisits[i]=lookupVisits[i]-visitsStart[i];
+#endif
+}
+
+static void printHeader() {
+   printf("build,op,n,Mops,p50ns,p99ns,p999ns");
+#ifdef ART_HW_COUNTERS
+   for (int i=0;i<COUNTER_EVENTS;i++)
+      printf(",%s",counterNames[i]);
+#endif
+#ifdef ART_VISIT_COUNTERS
+   for (int i=0;i<NodeTypeCount;i++)
+      printf(",visits.%s",nodeTypeNames[i]);
+#endif
+   printf("\n");
+}
+
+static void report(const char* build,const char* op,uint64_t n,uint64_t ops,double seconds,std::vector<uint64_t>* samples) {
+   // One CSV row: build,op,n,Mops,p50ns,p99ns,p999ns, then the enabled
+   // counters per operation; the percentiles stay empty for phases without
+   // per-operation samples
+   printf("%s,%s,%lu,%f",build,op,n,(ops/1000000.0)/seconds);
+   if (samples&&!samples->empty()) {
+      std::sort(samples->begin(),samples->end());
+      size_t m=samples->size();
+      printf(",%.1f,%.1f,%.1f",(*samples)[m/2]*nsPerCycle,(*samples)[m*99/100]*nsPerCycle,(*samples)[m*999/1000]*nsPerCycle);
+   } else {
+      printf(",,,");
+   }
+#ifdef ART_HW_COUNTERS
+   for (int i=0;i<COUNTER_EVENTS;i++)
+      if (phaseCounters[i]>=0)
+         printf(",%.3f",phaseCounters[i]/ops);
+      else
+         printf(",");
+#endif
+#ifdef ART_VISIT_COUNTERS
+   for (int i=0;i<NodeTypeCount;i++)
+      printf(",%.3f",static_cast<double>(phaseVisits[i])/ops);
+#endif
+   printf("\n");
+}
+
+// Results the timed loops got wrong; they are counted instead of asserted so
+// the measured code is the same in every build type, and make main fail
+static uint64_t wrongResults=0;
+
+static void checkResults(const char* build,const char* op,uint64_t wrong) {
+   if (wrong) {
+      fprintf(stderr,"%s,%s: %lu wrong results\n",build,op,wrong);
+      wrongResults+=wrong;
+   }
+}
+
+static bool loadDataset(const char* file,uint64_t n,std::vector<uint64_t>& keys) {
+   // SOSD layout: a uint64 key count followed by the keys, keys are read up
+   // to n (all of them if n is 0)
+   FILE* f=fopen(file,"rb");
+   if (!f)
+      return false;
+   uint64_t count;
+   bool ok=fread(&count,sizeof(count),1,f)==1;
+   if (ok) {
+      if (n&&n<count)
+         count=n;
+      keys.resize(count);
+      ok=fread(keys.data(),sizeof(uint64_t),count,f)==count;
+   }
+   fclose(f);
+   return ok;
+}
+
+static void uniqueKeys(std::vector<uint64_t>& keys) {
+   // Leaves store the key shifted by one bit, so the top bit is cleared;
+   // duplicates (in the data or from clearing) are dropped
+   for (uint64_t& key : keys)
+      key&=~(1ull<<63);
+   std::sort(keys.begin(),keys.end());
+   keys.erase(std::unique(keys.begin(),keys.end()),keys.end());
+}
+
+static void generateLognormal(uint64_t n,std::mt19937_64& rng,std::vector<uint64_t>& keys) {
+   // Lognormal(0,2) scaled by 1e9 like the SOSD synthetic set, redrawn
+   // until there are n distinct keys
+   std::lognormal_distribution<double> dist(0,2);
+   keys.clear();
+   while (keys.size()<n) {
+      while (keys.size()<n+n/8) {
+         double x=dist(rng)*1e9;
+         if (x>=1&&x<9e18)
+            keys.push_back(static_cast<uint64_t>(x));
+      }
+      uniqueKeys(keys);
+   }
+   keys.resize(n);
+}
+
+static void generateZipf(uint64_t n,uint64_t count,std::mt19937_64& rng,std::vector<uint64_t>& order) {
+   // Indices into the key set drawn from a Zipfian distribution over ranks
+   // (Gray et al., "Quickly generating billion-record synthetic databases"),
+   // ranks are scattered over the key set by a multiplicative hash so hot
+   // keys are not neighbours in the tree
+   double zetan=0;
+   for (uint64_t i=1;i<=n;i++)
+      zetan+=1/pow(i,ZIPF_THETA);
+   double zeta2=1+1/pow(2,ZIPF_THETA);
+   double alpha=1/(1-ZIPF_THETA);
+   double eta=(1-pow(2.0/n,1-ZIPF_THETA))/(1-zeta2/zetan);
+   std::uniform_real_distribution<double> uniform(0,1);
+   order.resize(count);
+   for (uint64_t i=0;i<count;i++) {
+      double u=uniform(rng);
+      double uz=u*zetan;
+      uint64_t rank;
+      if (uz<1)
+         rank=0;
+      else if (uz<zeta2)
+         rank=1;
+      else
+         rank=std::min<uint64_t>(n-1,static_cast<uint64_t>(n*pow(eta*u-eta+1,alpha)));
+      order[i]=(rank*0x9E3779B97F4A7C15ull)%n;
+   }
+}
+
+static Node* build(bool bulk,const std::vector<uint64_t>& keys,unsigned threads,const char* label) {
+   // Bulk load the learned tree, or insert the keys one by one into a
+   // classic tree; reported as the insert phase of the build
+   uint64_t n=keys.size();
+   Node* tree=NULL;
+   if (bulk) {
+      // insertBulk partitions its input in place, build from a copy so the
+      // lookup order stays the generated one
+      std::vector<uint64_t> bulkKeys(keys);
+      beginPhase();
+      double start=gettime();
+      if (threads==1)
+         insertBulk(NULL,&tree,bulkKeys.data(),n,0,8);
+      else
+         insertBulkParallel(&tree,bulkKeys.data(),n,threads,8);
+      endPhase();
+      if (label)
+         report(label,"insert",n,n,gettime()-start,NULL);
+   } else {
+      std::vector<uint64_t> samples;
+      samples.reserve(std::min(n,LATENCY_SAMPLES));
+      uint64_t sampleEvery=std::max<uint64_t>(1,n/LATENCY_SAMPLES);
+      beginPhase();
+      double start=gettime();
+      for (uint64_t i=0;i<n;i++) {
+         uint8_t key[8];loadKey(keys[i],key);
+         if (i%sampleEvery) {
+            insert(tree,&tree,key,0,keys[i],8);
+         } else {
+            uint64_t cycles=readCycles();
+            insert(tree,&tree,key,0,keys[i],8);
+            samples.push_back(readCycles()-cycles);
+         }
+      }
+      endPhase();
+      if (label)
+         report(label,"insert",n,n,gettime()-start,&samples);
+   }
+   return tree;
+}
+
+static void lookupPhase(const char* label,const char* op,Node* tree,const std::vector<uint64_t>& keys,const std::vector<uint64_t>& order,bool fixed) {
+   // Throughput over the whole probe order (repeated for small trees to get
+   // reproducible results), then latencies of a prefix of it; fixed selects
+   // the 8-byte specialization of lookup
+   uint64_t n=keys.size();
+   uint64_t repeat=std::max<uint64_t>(1,10000000/order.size());
+   uint64_t wrong=0;
+   beginPhase();
+   double start=gettime();
+   for (uint64_t r=0;r<repeat;r++) {
+      for (uint64_t i=0;i<order.size();i++) {
+         uint64_t value=keys[order[i]];
+         uint8_t key[8];loadKey(value,key);
+         Node* leaf=fixed?lookup<8,UInt64Loader>(tree,key):lookup(tree,key,8,0,8);
+         wrong+=!(isLeaf(leaf)&&getLeafValue(leaf)==value);
+      }
+   }
+   double seconds=gettime()-start;
+   endPhase();
+   std::vector<uint64_t> samples(std::min<uint64_t>(order.size(),LATENCY_SAMPLES));
+   for (uint64_t i=0;i<samples.size();i++) {
+      uint8_t key[8];loadKey(keys[order[i]],key);
+      uint64_t cycles=readCycles();
+      Node* leaf=fixed?lookup<8,UInt64Loader>(tree,key):lookup(tree,key,8,0,8);
+      samples[i]=readCycles()-cycles;
+      wrong+=!isLeaf(leaf);
+   }
+   report(label,op,n,order.size()*repeat,seconds,&samples);
+   checkResults(label,op,wrong);
+}
+
+// Keys per sorted ingest batch
+static const uint64_t MERGE_BATCH_KEYS=10000;
+
+// Levels of the snapshot copied to every NUMA node in lookupReplicated
+static const unsigned SNAPSHOT_REPLICA_LEVELS=2;
+
+static void snapshotLookupPhase(const char* label,const char* op,SnapshotTree& tree,const std::vector<uint64_t>& keys,unsigned threads) {
+   // Point lookups in generation order on snapshotRoot from threads reader
+   // threads (0: all cores), each on its share of the keys
+   if (threads==0)
+      threads=std::max(1u,std::thread::hardware_concurrency());
+   uint64_t n=keys.size();
+   uint64_t repeat=std::max<uint64_t>(1,10000000/n);
+   std::vector<uint64_t> wrong(threads);
+   auto reader=[&](unsigned self) {
+      EpochGuard guard;
+      Node* root=snapshotRoot(tree);
+      uint64_t w=0;
+      for (uint64_t r=0;r<repeat;r++) {
+         for (uint64_t i=self;i<n;i+=threads) {
+            uint8_t key[8];loadKey(keys[i],key);
+            Node* leaf=lookup(root,key,8,0,8);
+            w+=!(isLeaf(leaf)&&getLeafValue(leaf)==keys[i]);
+         }
+      }
+      wrong[self]=w;
+   };
+   beginPhase();
+   double start=gettime();
+   std::vector<std::thread> readers;
+   for (unsigned i=1;i<threads;i++)
+      readers.push_back(std::thread(reader,i));
+   reader(0);
+   for (std::thread& t : readers)
+      t.join();
+   endPhase();
+   report(label,op,n,n*repeat,gettime()-start,NULL);
+   uint64_t total=0;
+   for (uint64_t w : wrong)
+      total+=w;
+   checkResults(label,op,total);
+}
+
+static void runBenchmark(const char* label,bool bulk,const std::vector<uint64_t>& keys,const std::vector<uint64_t>& zipf,unsigned threads) {
+   // All phases on one tree: build, point lookups in generation and in
+   // Zipfian order, batched lookups, ordered scan, lookups on a mapped
+   // image, erase, destroy and batched ingest; for bulk loads also a lazy
+   // load, otherwise sorted appends with and without an insert hint
+   uint64_t n=keys.size();
+   Node* tree=build(bulk,keys,threads,label);
+   // the shape goes to stderr, stdout is CSV only
+   profile(tree,stderr);
+
+   std::vector<uint64_t> order(n);
+   for (uint64_t i=0;i<n;i++)
+      order[i]=i;
+   lookupPhase(label,"lookup",tree,keys,order,false);
+   lookupPhase(label,"lookupFixed",tree,keys,order,true);
+   lookupPhase(label,"lookupZipf",tree,keys,zipf,false);
+
+   // Same lookups, 1024 probe keys per batch
+   uint64_t repeat=std::max<uint64_t>(1,10000000/n);
+   Node* leaves[1024];
+   uint64_t wrong=0;
+   beginPhase();
+   double start=gettime();
+   for (uint64_t r=0;r<repeat;r++) {
+      for (uint64_t i=0;i<n;i+=1024) {
+         uint64_t batch=std::min<uint64_t>(1024,n-i);
+         lookupBatch(tree,keys.data()+i,batch,leaves);
+         for (uint64_t j=0;j<batch;j++)
+            wrong+=!(isLeaf(leaves[j])&&getLeafValue(leaves[j])==keys[i+j]);
+      }
+   }
+   endPhase();
+   report(label,"lookupBatch",n,n*repeat,gettime()-start,NULL);
+   checkResults(label,"lookupBatch",wrong);
+
+   // Ordered scan over all keys
+   beginPhase();
+   start=gettime();
+   uint64_t scanned=0;
+   Iterator it;
+   for (bool more=seekMinimum(tree,it);more;more=next(it))
+      scanned++;
+   endPhase();
+   report(label,"scan",n,scanned,gettime()-start,NULL);
+   checkResults(label,"scan",scanned>n?scanned-n:n-scanned);
+
+   // Write an image of the tree, map it and search it in place
+   char path[64];
+   snprintf(path,sizeof(path),"/tmp/art-%d.img",static_cast<int>(getpid()));
+   beginPhase();
+   start=gettime();
+   bool saved=serializeTree(tree,path);
+   endPhase();
+   report(label,"serialize",n,n,gettime()-start,NULL);
+   MappedTree mapped;
+   if (saved&&mapTree(path,mapped)) {
+      wrong=0;
+      beginPhase();
+      start=gettime();
+      for (uint64_t i=0;i<n;i++) {
+         uint8_t key[8];loadKey(keys[i],key);
+         Node* leaf=lookupMapped(mapped,key,8,8);
+         wrong+=!(isLeaf(leaf)&&getLeafValue(leaf)==keys[i]);
+      }
+      endPhase();
+      report(label,"lookupMapped",n,n,gettime()-start,NULL);
+      checkResults(label,"lookupMapped",wrong);
+      unmapTree(mapped);
+   } else {
+      fprintf(stderr,"cannot write or map %s\n",path);
+   }
+   unlink(path);
+
+   std::vector<uint64_t> samples;
+   samples.reserve(std::min(n,LATENCY_SAMPLES));
+   uint64_t sampleEvery=std::max<uint64_t>(1,n/LATENCY_SAMPLES);
+   beginPhase();
+   start=gettime();
+   for (uint64_t i=0;i<n;i++) {
+      uint8_t key[8];loadKey(keys[i],key);
+      if (i%sampleEvery) {
+         erase(tree,&tree,key,8,0,8);
+      } else {
+         uint64_t cycles=readCycles();
+         erase(tree,&tree,key,8,0,8);
+         samples.push_back(readCycles()-cycles);
+      }
+   }
+   endPhase();
+   report(label,"erase",n,n,gettime()-start,&samples);
+   checkResults(label,"erase",tree!=NULL);
+
+   // Rebuild and tear down the whole tree at once
+   tree=build(bulk,keys,threads,NULL);
+   beginPhase();
+   start=gettime();
+   destroy(tree);
+   endPhase();
+   report(label,"destroy",n,n,gettime()-start,NULL);
+
+   // Ingest the second half of the keys in sorted batches into a tree
+   // built from the first half, key by key and with mergeBatch
+   uint64_t half=n/2;
+   std::vector<uint64_t> firstHalf(keys.begin(),keys.begin()+half);
+   std::vector<uint64_t> batches(keys.begin()+half,keys.end());
+   for (uint64_t i=0;i<batches.size();i+=MERGE_BATCH_KEYS)
+      std::sort(batches.begin()+i,batches.begin()+std::min<uint64_t>(batches.size(),i+MERGE_BATCH_KEYS));
+   for (int merged=0;merged<2;merged++) {
+      tree=build(bulk,firstHalf,threads,NULL);
+      beginPhase();
+      start=gettime();
+      for (uint64_t i=0;i<batches.size();i+=MERGE_BATCH_KEYS) {
+         uint64_t batch=std::min<uint64_t>(MERGE_BATCH_KEYS,batches.size()-i);
+         if (merged) {
+            mergeBatch(&tree,batches.data()+i,batch,8);
+         } else {
+            for (uint64_t j=i;j<i+batch;j++) {
+               uint8_t key[8];loadKey(batches[j],key);
+               insert(tree,&tree,key,0,batches[j],8);
+            }
+         }
+      }
+      endPhase();
+      report(label,merged?"mergeBatch":"insertBatch",n,batches.size(),gettime()-start,NULL);
+      destroy(tree);
+   }
+
+   std::vector<uint64_t> sorted(keys);
+   std::sort(sorted.begin(),sorted.end());
+   if (!bulk) {
+      // Append the keys in sorted order, from the root every time and
+      // resuming at the path of the previous key
+      for (int hinted=0;hinted<2;hinted++) {
+         InsertHint hint;
+         tree=NULL;
+         beginPhase();
+         start=gettime();
+         for (uint64_t i=0;i<n;i++) {
+            uint8_t key[8];loadKey(sorted[i],key);
+            if (hinted)
+               insertWithHint(&tree,key,sorted[i],8,hint);
+            else
+               insert(tree,&tree,key,0,sorted[i],8);
+         }
+         endPhase();
+         report(label,hinted?"insertSortedHint":"insertSorted",n,n,gettime()-start,NULL);
+         destroy(tree);
+      }
+      return;
+   }
+   // Lookups from parallel readers of a snapshot, once with its top levels
+   // replicated on every NUMA node
+   for (int replicated=0;replicated<2;replicated++) {
+      SnapshotTree snapshot;
+      snapshot.replicaLevels=replicated?SNAPSHOT_REPLICA_LEVELS:0;
+      std::vector<uint64_t> snapshotKeys(keys);
+      publishSnapshot(snapshot,snapshotKeys.data(),n,threads,8);
+      snapshotLookupPhase(label,replicated?"lookupReplicated":"lookupSnapshot",snapshot,keys,threads);
+   }
+
+   // Leaves as records with a payload: bulk load over the record
+   // addresses, then fixed-width lookups that also read the payload
+   {
+      LeafArena records(8);
+      std::vector<uint64_t> tids(n);
+      for (uint64_t i=0;i<n;i++) {
+         uint8_t key[8];loadKeyUInt64(keys[i],key);
+         tids[i]=reinterpret_cast<uintptr_t>(allocRecord(records,key,8,i));
+      }
+      KeyLoader previous=setKeyLoader(loadKeyRecord);
+      tree=NULL;
+      beginPhase();
+      start=gettime();
+      insertBulk(NULL,&tree,tids.data(),n,0,8);
+      endPhase();
+      report(label,"insertRecord",n,n,gettime()-start,NULL);
+      beginPhase();
+      start=gettime();
+      wrong=0;
+      for (uint64_t i=0;i<n;i++) {
+         uint8_t key[8];loadKeyUInt64(keys[i],key);
+         Node* leaf=lookup<8,RecordLoader<8>>(tree,key);
+         wrong+=!(leaf&&leafRecord(leaf)->payload==i);
+      }
+      endPhase();
+      report(label,"lookupRecord",n,n,gettime()-start,NULL);
+      checkResults(label,"lookupRecord",wrong);
+      destroy(tree);
+      setKeyLoader(previous);
+   }
+
+   // Lazy bulk load of the sorted keys, then the first lookup of every key
+   // (building the subtrees on the way) and a second, warm pass
+   tree=NULL;
+   beginPhase();
+   start=gettime();
+   insertBulkLazy(&tree,sorted.data(),n,8);
+   endPhase();
+   report(label,"buildLazy",n,n,gettime()-start,NULL);
+   for (int pass=0;pass<2;pass++) {
+      const char* op=pass?"lookupLazyWarm":"lookupLazy";
+      wrong=0;
+      beginPhase();
+      start=gettime();
+      for (uint64_t i=0;i<n;i++) {
+         uint8_t key[8];loadKey(keys[i],key);
+         Node* leaf=lookup(tree,key,8,0,8);
+         wrong+=!(isLeaf(leaf)&&getLeafValue(leaf)==keys[i]);
+      }
+      endPhase();
+      report(label,op,n,n,gettime()-start,NULL);
+      checkResults(label,op,wrong);
+   }
+   destroy(tree);
+}
+
+static void runStreamBenchmark(const char* file,const std::vector<uint64_t>& keys) {
+   // Streaming bulk load of the whole file, then lookups of the probe keys
+   Node* tree=NULL;
+   beginPhase();
+   double start=gettime();
+   uint64_t loaded;
+   bool ok=insertBulkFile(&tree,file,8,&loaded);
+   endPhase();
+   if (!ok) {
+      fprintf(stderr,"cannot stream %s\n",file);
+      destroy(tree);
+      return;
+   }
+   report("stream","insert",loaded,loaded,gettime()-start,NULL);
+   profile(tree,stderr);
+   uint64_t n=keys.size();
+   std::vector<uint64_t> order(n);
+   for (uint64_t i=0;i<n;i++)
+      order[i]=i;
+   lookupPhase("stream","lookup",tree,keys,order,false);
+   destroy(tree);
+}
+
+// Keys per data set of the baseline, and runs of each timed baseline
+// lookup phase (the median is kept)
+static const uint64_t BASELINE_KEYS=100000;
+static const int BASELINE_RUNS=5;
+
+static double baselineLookups(Node* tree,const std::vector<uint64_t>& keys,bool fixed,uint64_t& wrong) {
+   // Median Mops of BASELINE_RUNS passes of point lookups in generation order
+   std::vector<double> mops;
+   for (int run=0;run<BASELINE_RUNS;run++) {
+      double start=gettime();
+      for (uint64_t i=0;i<keys.size();i++) {
+         uint8_t key[8];loadKey(keys[i],key);
+         Node* leaf=fixed?lookup<8,UInt64Loader>(tree,key):lookup(tree,key,8,0,8);
+         wrong+=!(isLeaf(leaf)&&getLeafValue(leaf)==keys[i]);
+      }
+      mops.push_back((keys.size()/1000000.0)/(gettime()-start));
+   }
+   std::sort(mops.begin(),mops.end());
+   return mops[BASELINE_RUNS/2];
+}
+
+static void writeBaseline(FILE* out) {
+   // Long format dataset,build,kind,metric,value: "shape" rows are the node
+   // counts, bytes and depths of the tree and depend only on the code, so
+   // they must not change unless the tree layout is meant to; "time" rows
+   // are the lookup and lookupFixed throughput in Mops
+   fprintf(out,"dataset,build,kind,metric,value\n");
+   const char* datasets[]={"dense","sparse","lognormal"};
+   for (int d=0;d<3;d++) {
+      std::mt19937_64 rng(42);
+      std::vector<uint64_t> keys;
+      if (d==0) {
+         for (uint64_t i=0;i<BASELINE_KEYS;i++)
+            keys.push_back(i+1);
+      } else if (d==1) {
+         while (keys.size()<BASELINE_KEYS) {
+            for (uint64_t i=keys.size();i<BASELINE_KEYS;i++)
+               keys.push_back(rng());
+            uniqueKeys(keys);
+         }
+      } else {
+         generateLognormal(BASELINE_KEYS,rng,keys);
+      }
+      std::shuffle(keys.begin(),keys.end(),rng);
+      for (int bulk=1;bulk>=0;bulk--) {
+         const char* build=bulk?"bulk":"insert";
+         Node* tree=::build(bulk,keys,1,NULL);
+         TreeStats stats;
+         collectStats(tree,stats);
+         double depth=0;
+         for (unsigned l=0;l<STATS_MAX_LEVEL;l++)
+            depth+=static_cast<double>(l)*stats.leafLevel[l];
+         const char* row="%s,%s,shape,%s,%zu\n";
+         fprintf(out,row,datasets[d],build,"leaves",stats.leaves);
+         fprintf(out,row,datasets[d],build,"height",static_cast<size_t>(stats.height));
+         fprintf(out,"%s,%s,shape,leafDepthMean,%.4f\n",datasets[d],build,depth/stats.leaves);
+         for (int t=0;t<NodeTypeCount;t++) {
+            std::string nodes=std::string("nodes.")+nodeTypeNames[t];
+            std::string bytes=std::string("bytes.")+nodeTypeNames[t];
+            fprintf(out,row,datasets[d],build,nodes.c_str(),stats.nodes[t]);
+            fprintf(out,row,datasets[d],build,bytes.c_str(),stats.bytes[t]);
+         }
+         uint64_t wrong=0;
+         double mops=baselineLookups(tree,keys,false,wrong);
+         fprintf(out,"%s,%s,time,lookup.Mops,%.3f\n",datasets[d],build,mops);
+         mops=baselineLookups(tree,keys,true,wrong);
+         fprintf(out,"%s,%s,time,lookupFixed.Mops,%.3f\n",datasets[d],build,mops);
+         checkResults(build,"baseline",wrong);
+         destroy(tree);
+      }
+   }
+}
+
+static bool readBaseline(FILE* in,std::map<std::string,std::string>& rows) {
+   // Rows of a baseline keyed by dataset,build,kind,metric
+   char line[256];
+   if (!fgets(line,sizeof(line),in))
+      return false;
+   while (fgets(line,sizeof(line),in)) {
+      char* value=strrchr(line,',');
+      if (!value)
+         return false;
+      *value++=0;
+      value[strcspn(value,"\r\n")]=0;
+      rows[line]=value;
+   }
+   return true;
+}
+
+static int compareBaseline(FILE* current,const char* file,double tolerance) {
+   // Number of rows that differ from the reference baseline in file: shape
+   // rows must be equal, time rows may be at most tolerance (a fraction)
+   // slower; timing is only compared for a positive tolerance
+   std::map<std::string,std::string> now,reference;
+   FILE* in=fopen(file,"r");
+   bool ok=in&&readBaseline(in,reference);
+   if (in)
+      fclose(in);
+   if (!ok||!readBaseline(current,now)) {
+      fprintf(stderr,"cannot read baseline %s\n",file);
+      return 1;
+   }
+   int regressions=0;
+   for (auto& row : reference) {
+      auto it=now.find(row.first);
+      bool timing=row.first.find(",time,")!=std::string::npos;
+      if (it==now.end()) {
+         fprintf(stderr,"%s: missing\n",row.first.c_str());
+         regressions++;
+      } else if (!timing&&it->second!=row.second) {
+         fprintf(stderr,"%s: %s, baseline %s\n",row.first.c_str(),it->second.c_str(),row.second.c_str());
+         regressions++;
+      } else if (timing&&tolerance>0&&atof(it->second.c_str())<atof(row.second.c_str())*(1-tolerance)) {
+         fprintf(stderr,"%s: %s Mops, baseline %s\n",row.first.c_str(),it->second.c_str(),row.second.c_str());
+         regressions++;
+      }
+   }
+   return regressions;
+}
+
+static int runBaseline(const char* reference,double tolerance) {
+   // Print the baseline, and with a reference file compare against it
+   if (!reference) {
+      writeBaseline(stdout);
+      return wrongResults?1:0;
+   }
+   FILE* current=tmpfile();
+   if (!current) {
+      fprintf(stderr,"cannot create a temporary file\n");
+      return 1;
+   }
+   writeBaseline(current);
+   rewind(current);
+   int c;
+   while ((c=fgetc(current))!=EOF)
+      putchar(c);
+   rewind(current);
+   int regressions=compareBaseline(current,reference,tolerance);
+   fclose(current);
+   if (regressions)
+      fprintf(stderr,"%d rows differ from %s\n",regressions,reference);
+   return (regressions||wrongResults)?1:0;
+}
+
+int main(int argc,char** argv) {
+   if (argc>=2&&strcmp(argv[1],"baseline")==0)
+      return runBaseline(argc>=3?argv[2]:NULL,argc>=4?atof(argv[3]):0);
+   if (argc<3 || argc>5) {
+      printf("usage: %s n 0|1|2|3|file [threads] [compare]\n"
+             "n: number of keys (for a file: at most, 0 for all)\n"
+             "0: sorted keys\n1: dense keys\n2: sparse keys\n3: lognormal keys\n"
+             "file: SOSD key file (uint64 count followed by sorted uint64 keys), also\n"
+             "      loaded by a streaming bulk load\n"
+             "threads: bulk load and snapshot reader threads (0: all cores, default 1)\n"
+             "compare: 1 also runs all phases on a tree built by repeated insert\n"
+             "\n"
+             "usage: %s baseline [reference.csv [tolerance]]\n"
+             "prints the tree shapes and lookup throughput of fixed 100k key sets as\n"
+             "CSV; with a reference, fails on changed shapes and, for a tolerance > 0,\n"
+             "on lookups slower by more than that fraction\n", argv[0], argv[0]);
+      return 1;
+   }
+
+   uint64_t n=strtoull(argv[1],NULL,10);
+   unsigned threads=(argc>=4)?atoi(argv[3]):1;
+   bool compare=(argc==5)&&atoi(argv[4]);
+   std::mt19937_64 rng(42);
+   std::vector<uint64_t> keys;
+
+   // Generate or load keys
+   const char* dataset=argv[2];
+   bool fromFile=false;
+   if (strcmp(dataset,"0")==0||strcmp(dataset,"1")==0) {
+      // dense, sorted
+      keys.resize(n);
+      for (uint64_t i=0;i<n;i++)
+         keys[i]=i+1;
+   } else if (strcmp(dataset,"2")==0) {
+      // "pseudo-sparse" (the most-significant leaf bit gets lost)
+      keys.resize(n);
+      for (uint64_t i=0;i<n;i++)
+         keys[i]=(static_cast<uint64_t>(rand())<<32) | static_cast<uint64_t>(rand());
+   } else if (strcmp(dataset,"3")==0) {
+      generateLognormal(n,rng,keys);
+   } else {
+      fromFile=true;
+      if (!loadDataset(dataset,n,keys)) {
+         fprintf(stderr,"cannot read %s\n",dataset);
+         return 1;
+      }
+      uniqueKeys(keys);
+   }
+   // Probe in random order, except for the sorted set
+   if (strcmp(dataset,"0")!=0)
+      std::shuffle(keys.begin(),keys.end(),rng);
+   n=keys.size();
+   if (n==0)
+      return 1;
+
+   std::vector<uint64_t> zipf;
+   generateZipf(n,n,rng,zipf);
+   calibrateCycles();
+   openCounters();
+
+   printHeader();
+   runBenchmark("bulk",true,keys,zipf,threads);
+   if (compare)
+      runBenchmark("insert",false,keys,zipf,threads);
+   if (fromFile)
+      runStreamBenchmark(dataset,keys);
+
+   return wrongResults?1:0;
+}
@@ -0,0 +1,564 @@
+/*
+  Tests of the Adaptive Radix Tree library: each group checks one family of
+  operations against a sorted reference set. Run all groups, or the groups
+  named on the command line; the exit status is 1 if any check failed
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <random>
+#include <unistd.h>    // access, getpid, unlink
+#include "ART.hpp"
+
+static unsigned failures=0;
+
+#define CHECK(cond) do { if (!(cond)) { failures++; fprintf(stderr,"%s:%d: CHECK(%s) failed\n",__FILE__,__LINE__,#cond); } } while (0)
+
+static std::vector<uint64_t> randomKeys(uint64_t n,uint64_t seed,uint64_t mask) {
+   // n distinct keys drawn from rng()&mask, in random order; the top bit is
+   // always cleared since the default leaves store the key shifted by one
+   std::mt19937_64 rng(seed);
+   std::set<uint64_t> seen;
+   std::vector<uint64_t> keys;
+   while (keys.size()<n) {
+      uint64_t key=rng()&mask&~(1ull<<63);
+      if (seen.insert(key).second)
+         keys.push_back(key);
+   }
+   return keys;
+}
+
+static bool found(Node* tree,uint64_t value) {
+   uint8_t key[8];loadKey(value,key);
+   Node* leaf=lookup(tree,key,8,0,8);
+   return isLeaf(leaf)&&getLeafValue(leaf)==value;
+}
+
+static uint64_t checkTree(Node* tree,const std::set<uint64_t>& present) {
+   // Every key of present is found with both lookups and the ordered scan
+   // yields exactly present; returns the number of leaves scanned
+   uint64_t missing=0;
+   for (uint64_t value : present) {
+      uint8_t key[8];loadKey(value,key);
+      Node* leaf=lookup<8,UInt64Loader>(tree,key);
+      missing+=!(found(tree,value)&&isLeaf(leaf)&&getLeafValue(leaf)==value);
+   }
+   CHECK(missing==0);
+   Iterator it;
+   auto expected=present.begin();
+   uint64_t scanned=0,misordered=0;
+   for (bool more=seekMinimum(tree,it);more;more=next(it),scanned++) {
+      if (expected==present.end()||getLeafValue(it.leaf)!=*expected)
+         misordered++;
+      else
+         ++expected;
+   }
+   CHECK(misordered==0);
+   CHECK(scanned==present.size());
+   TreeStats stats;
+   collectStats(tree,stats);
+   CHECK(stats.leaves+stats.lazyKeys==present.size());
+   return scanned;
+}
+
+static void testInsert() {
+   // Generic and fixed-width insert, lookup and erase on random, dense and
+   // clustered keys; absent keys are not found
+   for (uint64_t mask : {~0ull,0xFFFFFull,0xFF00FF00FFull}) {
+      std::vector<uint64_t> keys=randomKeys(mask==0xFFFFFull?500000:100000,mask,mask);
+      std::set<uint64_t> present;
+      Node* tree=NULL;
+      for (uint64_t i=0;i<keys.size();i++) {
+         uint8_t key[8];loadKey(keys[i],key);
+         if (i%2)
+            insert(tree,&tree,key,0,keys[i],8);
+         else
+            insert<8,UInt64Loader>(tree,&tree,key,keys[i]);
+         present.insert(keys[i]);
+      }
+      checkTree(tree,present);
+      uint64_t absent=0;
+      for (uint64_t probe : randomKeys(1000,7,mask))
+         absent+=!present.count(probe)&&found(tree,probe);
+      CHECK(absent==0);
+      for (uint64_t i=0;i<keys.size();i+=2) {
+         uint8_t key[8];loadKey(keys[i],key);
+         bool erased=(i%4)?erase(tree,&tree,key,8,0,8):erase<8,UInt64Loader>(tree,&tree,key);
+         CHECK(erased);
+         present.erase(keys[i]);
+      }
+      checkTree(tree,present);
+      for (uint64_t i=1;i<keys.size();i+=2) {
+         uint8_t key[8];loadKey(keys[i],key);
+         erase(tree,&tree,key,8,0,8);
+      }
+      CHECK(tree==NULL);
+   }
+}
+
+static void testBulk() {
+   // Bulk loads, sequential and parallel, then updates of the learned tree;
+   // lazy bulk loads before and after materializeTree; batched lookups
+   for (uint64_t mask : {~0ull,0xFFFFFFull}) {
+      std::vector<uint64_t> keys=randomKeys(300000,mask+1,mask);
+      std::set<uint64_t> present(keys.begin(),keys.end());
+      for (unsigned threads=1;threads<=2;threads++) {
+         std::vector<uint64_t> input(keys);
+         Node* tree=NULL;
+         if (threads==1)
+            insertBulk(NULL,&tree,input.data(),input.size(),0,8);
+         else
+            insertBulkParallel(&tree,input.data(),input.size(),threads,8);
+         checkTree(tree,present);
+         std::vector<Node*> leaves(keys.size());
+         lookupBatch(tree,keys.data(),keys.size(),leaves.data());
+         uint64_t wrong=0;
+         for (uint64_t i=0;i<keys.size();i++)
+            wrong+=!(isLeaf(leaves[i])&&getLeafValue(leaves[i])==keys[i]);
+         CHECK(wrong==0);
+         std::set<uint64_t> updated(present);
+         for (uint64_t key : randomKeys(50000,threads,mask)) {
+            uint8_t bytes[8];loadKey(key,bytes);
+            if (updated.insert(key).second)
+               insert(tree,&tree,bytes,0,key,8);
+         }
+         for (uint64_t i=0;i<keys.size();i+=3) {
+            uint8_t bytes[8];loadKey(keys[i],bytes);
+            CHECK(erase(tree,&tree,bytes,8,0,8));
+            updated.erase(keys[i]);
+         }
+         checkTree(tree,updated);
+         destroy(tree);
+      }
+      std::vector<uint64_t> sorted(present.begin(),present.end());
+      Node* tree=NULL;
+      insertBulkLazy(&tree,sorted.data(),sorted.size(),8);
+      uint64_t wrong=0;
+      for (uint64_t i=0;i<keys.size();i+=7)
+         wrong+=!found(tree,keys[i]);
+      CHECK(wrong==0);
+      checkTree(tree,present);
+      materializeTree(&tree);
+      TreeStats stats;
+      collectStats(tree,stats);
+      CHECK(stats.lazyKeys==0);
+      checkTree(tree,present);
+      destroy(tree);
+   }
+}
+
+static void testIterator() {
+   // lowerBound, upperBound and prev against std::set
+   std::vector<uint64_t> keys=randomKeys(100000,11,0xFFFFFFFFull);
+   std::set<uint64_t> present(keys.begin(),keys.end());
+   Node* tree=NULL;
+   for (uint64_t value : keys) {
+      uint8_t key[8];loadKey(value,key);
+      insert(tree,&tree,key,0,value,8);
+   }
+   std::mt19937_64 rng(12);
+   uint64_t wrong=0;
+   for (int i=0;i<10000;i++) {
+      uint64_t probe=(i%2)?keys[rng()%keys.size()]:(rng()&0xFFFFFFFFull);
+      uint8_t key[8];loadKey(probe,key);
+      Iterator it;
+      auto lower=present.lower_bound(probe);
+      bool more=lowerBound(tree,key,8,8,it);
+      wrong+=more!=(lower!=present.end())||(more&&getLeafValue(it.leaf)!=*lower);
+      auto upper=present.upper_bound(probe);
+      more=upperBound(tree,key,8,8,it);
+      wrong+=more!=(upper!=present.end())||(more&&getLeafValue(it.leaf)!=*upper);
+   }
+   CHECK(wrong==0);
+   Iterator it;
+   auto expected=present.rbegin();
+   uint64_t scanned=0;
+   for (bool more=seekMaximum(tree,it);more;more=prev(it),scanned++)
+      if (scanned<present.size())
+         wrong+=getLeafValue(it.leaf)!=*expected++;
+   CHECK(wrong==0);
+   CHECK(scanned==present.size());
+   destroy(tree);
+}
+
+static void testMerge() {
+   // Sorted batches with mergeBatch into bulk-loaded and empty trees, and
+   // sorted appends with insertWithHint
+   std::vector<uint64_t> keys=randomKeys(400000,21,0xFFFFFFFFFFull);
+   std::vector<uint64_t> first(keys.begin(),keys.begin()+keys.size()/2);
+   std::set<uint64_t> present(first.begin(),first.end());
+   Node* tree=NULL;
+   insertBulk(NULL,&tree,first.data(),first.size(),0,8);
+   for (uint64_t i=keys.size()/2;i<keys.size();i+=10000) {
+      std::vector<uint64_t> batch(keys.begin()+i,keys.begin()+std::min<uint64_t>(keys.size(),i+10000));
+      // a key of the tree updates its leaf
+      batch.push_back(first[i%first.size()]);
+      std::sort(batch.begin(),batch.end());
+      mergeBatch(&tree,batch.data(),batch.size(),8);
+      present.insert(batch.begin(),batch.end());
+   }
+   checkTree(tree,present);
+   destroy(tree);
+
+   std::vector<uint64_t> sorted(present.begin(),present.end());
+   InsertHint hint;
+   tree=NULL;
+   for (uint64_t value : sorted) {
+      uint8_t key[8];loadKey(value,key);
+      insertWithHint(&tree,key,value,8,hint);
+   }
+   checkTree(tree,present);
+   destroy(tree);
+}
+
+static void testSnapshot() {
+   // Readers of a snapshot, with and without replicated top levels, while
+   // rebuilds publish supersets of the keys
+   const uint64_t n=100000;
+   std::vector<uint64_t> common(n);
+   for (uint64_t i=0;i<n;i++)
+      common[i]=i*7919+13;
+   for (unsigned levels=0;levels<=2;levels+=2) {
+      SnapshotTree tree;
+      tree.replicaLevels=levels;
+      std::vector<uint64_t> keys(common);
+      publishSnapshot(tree,keys.data(),n,1,8);
+      std::atomic<bool> done(false);
+      std::atomic<uint64_t> wrong(0);
+      std::vector<std::thread> readers;
+      for (unsigned r=0;r<2;r++)
+         readers.push_back(std::thread([&,r] {
+            uint64_t i=r;
+            while (!done) {
+               EpochGuard guard;
+               Node* root=snapshotRoot(tree);
+               for (int j=0;j<100;j++,i+=7777)
+                  wrong+=!found(root,common[i%n]);
+            }
+         }));
+      for (unsigned round=0;round<5;round++) {
+         std::vector<uint64_t> more(common);
+         for (uint64_t i=0;i<n/2;i++)
+            more.push_back(n*8000+round*n+i*3+1);
+         publishSnapshot(tree,more.data(),more.size(),1+round%2,8);
+      }
+      done=true;
+      for (std::thread& t : readers)
+         t.join();
+      CHECK(wrong==0);
+      EpochGuard guard;
+      CHECK(found(snapshotRoot(tree),common[0]));
+   }
+}
+
+static void testImage() {
+   // An image written by serializeTree and searched in place
+   std::vector<uint64_t> keys=randomKeys(200000,31,~0ull);
+   std::vector<uint64_t> input(keys);
+   Node* tree=NULL;
+   insertBulk(NULL,&tree,input.data(),input.size(),0,8);
+   char path[64];
+   snprintf(path,sizeof(path),"/tmp/art-test-%d.img",static_cast<int>(getpid()));
+   CHECK(serializeTree(tree,path));
+   MappedTree mapped;
+   CHECK(mapTree(path,mapped));
+   uint64_t wrong=0;
+   for (uint64_t value : keys) {
+      uint8_t key[8];loadKey(value,key);
+      Node* leaf=lookupMapped(mapped,key,8,8);
+      wrong+=!(isLeaf(leaf)&&getLeafValue(leaf)==value);
+   }
+   CHECK(wrong==0);
+   unmapTree(mapped);
+
+   // A truncated image is rejected, the lookups on corrupted ones must not
+   // leave the mapping (run with ASan to see it)
+   std::vector<uint8_t> image;
+   FILE* f=fopen(path,"rb");
+   CHECK(f);
+   if (f) {
+      int c;
+      while ((c=fgetc(f))!=EOF)
+         image.push_back(c);
+      fclose(f);
+   }
+   std::mt19937_64 rng(32);
+   for (int round=0;round<20&&image.size()>64;round++) {
+      std::vector<uint8_t> corrupt(image);
+      if (round==0)
+         corrupt.resize(corrupt.size()/2);
+      else
+         for (int i=0;i<256;i++)
+            corrupt[64+rng()%(corrupt.size()-64)]=rng();
+      f=fopen(path,"wb");
+      CHECK(f&&fwrite(corrupt.data(),1,corrupt.size(),f)==corrupt.size());
+      if (f)
+         fclose(f);
+      bool opened=mapTree(path,mapped);
+      CHECK(round>0||!opened);
+      if (opened) {
+         for (uint64_t value : keys) {
+            uint8_t key[8];loadKey(value,key);
+            lookupMapped(mapped,key,8,8);
+         }
+         unmapTree(mapped);
+      }
+   }
+   unlink(path);
+   destroy(tree);
+}
+
+static void testRecords() {
+   // Leaves as records: full 64-bit keys with a payload, generic and
+   // fixed-width operations, and variable-length string keys
+   LeafArena arena(8);
+   std::vector<uint64_t> keys=randomKeys(100000,41,~0ull);
+   std::vector<uint64_t> tids;
+   for (uint64_t i=0;i<keys.size();i++) {
+      // the top bit is allowed in records
+      uint8_t key[8];loadKeyUInt64(keys[i]|(i%2?1ull<<63:0),key);
+      tids.push_back(reinterpret_cast<uintptr_t>(allocRecord(arena,key,8,i)));
+   }
+   KeyLoader previous=setKeyLoader(loadKeyRecord);
+   std::vector<uint64_t> input(tids);
+   Node* tree=NULL;
+   insertBulk(NULL,&tree,input.data(),input.size(),0,8);
+   uint64_t wrong=0;
+   for (uint64_t i=0;i<keys.size();i++) {
+      uint8_t key[8];loadKeyRecord(tids[i],key);
+      Node* leaf=lookup<8,RecordLoader<8>>(tree,key);
+      wrong+=!(leaf&&leaf==lookup(tree,key,8,0,8)&&leafRecord(leaf)->payload==i);
+   }
+   CHECK(wrong==0);
+   for (uint64_t i=0;i<keys.size();i+=2) {
+      uint8_t key[8];loadKeyRecord(tids[i],key);
+      bool erased=(i%4)?erase(tree,&tree,key,8,0,8):erase<8,RecordLoader<8>>(tree,&tree,key);
+      CHECK(erased);
+      freeRecord(arena,reinterpret_cast<LeafRecord*>(tids[i]));
+   }
+   for (uint64_t i=1;i<keys.size();i+=2) {
+      uint8_t key[8];loadKeyRecord(tids[i],key);
+      wrong+=!lookup<8,RecordLoader<8>>(tree,key);
+   }
+   CHECK(wrong==0);
+   // Record addresses mean nothing in an image
+   char path[64];
+   snprintf(path,sizeof(path),"/tmp/art-test-%d.img",static_cast<int>(getpid()));
+   CHECK(!serializeTree(tree,path));
+   CHECK(access(path,F_OK)!=0);
+   destroy(tree);
+
+   const unsigned maxKeyLength=24;
+   LeafArena strings(maxKeyLength);
+   std::mt19937_64 rng(42);
+   std::set<std::string> words;
+   while (words.size()<50000) {
+      std::string word;
+      for (unsigned j=0,length=1+rng()%20;j<length;j++)
+         word+=static_cast<char>('a'+rng()%4);
+      words.insert(word);
+   }
+   tids.clear();
+   for (const std::string& word : words)
+      tids.push_back(reinterpret_cast<uintptr_t>(allocRecord(strings,reinterpret_cast<const uint8_t*>(word.c_str()),word.size()+1,tids.size())));
+   tree=NULL;
+   insertBulk(NULL,&tree,tids.data(),tids.size(),0,maxKeyLength);
+   uint64_t i=0;
+   for (const std::string& word : words) {
+      uint8_t key[maxKeyLength]={};
+      memcpy(key,word.c_str(),word.size()+1);
+      Node* leaf=lookup(tree,key,word.size()+1,0,maxKeyLength);
+      wrong+=!(leaf&&leafRecord(leaf)->payload==i++);
+   }
+   CHECK(wrong==0);
+   Iterator it;
+   i=0;
+   for (bool more=seekMinimum(tree,it);more;more=next(it))
+      wrong+=leafRecord(it.leaf)->payload!=i++;
+   CHECK(wrong==0);
+   CHECK(i==words.size());
+   destroy(tree);
+   setKeyLoader(previous);
+}
+
+static void testArena() {
+   // Nodes freed by a thread that uses another arena go back to the arena
+   // that allocated them: rebuilding the tree there needs no new pages
+   std::vector<uint64_t> keys=randomKeys(200000,71,0xFFFFFFFFFFull);
+   Arena arena;
+   Node* tree=NULL;
+   auto build=[&] {
+      std::thread([&] {
+         Arena* previous=setArena(&arena);
+         for (uint64_t value : keys) {
+            uint8_t key[8];loadKey(value,key);
+            insert(tree,&tree,key,0,value,8);
+         }
+         setArena(previous);
+      }).join();
+   };
+   build();
+   size_t built=arenaMemory(&arena);
+   CHECK(built>0);
+   std::set<uint64_t> present(keys.begin(),keys.end());
+   checkTree(tree,present);
+   // erased on this thread, with the default arena
+   for (uint64_t value : keys) {
+      uint8_t key[8];loadKey(value,key);
+      CHECK(erase(tree,&tree,key,8,0,8));
+   }
+   CHECK(tree==NULL);
+   build();
+   CHECK(arenaMemory(&arena)==built);
+   checkTree(tree,present);
+   // the tree goes with its arena
+   tree=NULL;
+}
+
+struct VectorReader {
+   const uint64_t* keys;
+   size_t n, pos, step;
+};
+
+static size_t readVector(void* context,uint64_t* out,size_t room) {
+   // At most step keys per call, so the chunks do not line up with the
+   // chunks of the streaming bulk load
+   VectorReader* reader=static_cast<VectorReader*>(context);
+   size_t count=std::min(std::min(room,reader->step),reader->n-reader->pos);
+   memcpy(out,reader->keys+reader->pos,count*sizeof(uint64_t));
+   reader->pos+=count;
+   return count;
+}
+
+static void testStream() {
+   // Streaming bulk loads of sorted keys with duplicates, from memory and
+   // from an SOSD file
+   for (uint64_t mask : {~0ull,0xFFFFFFull}) {
+      std::vector<uint64_t> keys=randomKeys(1500000,mask^51,mask);
+      for (uint64_t i=0;i<1000;i++)
+         keys.push_back(keys[i*997]);
+      std::sort(keys.begin(),keys.end());
+      std::set<uint64_t> present(keys.begin(),keys.end());
+      std::vector<uint64_t> sample;
+      for (size_t j=0;j<4096;j++)
+         sample.push_back(keys[j*(keys.size()-1)/4095]);
+      VectorReader reader={keys.data(),keys.size(),0,777777};
+      Node* tree=NULL;
+      insertBulkStream(&tree,readVector,&reader,keys.size(),sample.data(),sample.size(),8);
+      checkTree(tree,present);
+      destroy(tree);
+   }
+
+   std::vector<uint64_t> keys(300000);
+   for (uint64_t i=0;i<keys.size();i++)
+      keys[i]=i*3+7;
+   char path[64];
+   snprintf(path,sizeof(path),"/tmp/art-test-%d.sosd",static_cast<int>(getpid()));
+   FILE* f=fopen(path,"wb");
+   CHECK(f);
+   if (!f)
+      return;
+   uint64_t count=keys.size();
+   fwrite(&count,sizeof(count),1,f);
+   fwrite(keys.data(),sizeof(uint64_t),count,f);
+   fclose(f);
+   Node* tree=NULL;
+   uint64_t loaded;
+   CHECK(insertBulkFile(&tree,path,8,&loaded));
+   CHECK(loaded==count);
+   checkTree(tree,std::set<uint64_t>(keys.begin(),keys.end()));
+   destroy(tree);
+   unlink(path);
+   tree=NULL;
+   CHECK(!insertBulkFile(&tree,path,8,&loaded));
+   CHECK(loaded==0);
+}
+
+static void testOLC() {
+   // Concurrent writers and readers with optimistic lock coupling
+   std::vector<uint64_t> keys=randomKeys(200000,61,0xFFFFFFFFFFull);
+   uint64_t half=keys.size()/2;
+   ConcurrentTree tree;
+   for (uint64_t i=0;i<half;i++) {
+      uint8_t key[8];loadKey(keys[i],key);
+      insertOLC(tree,key,keys[i],8);
+   }
+   std::atomic<bool> done(false);
+   std::atomic<uint64_t> wrong(0);
+   std::vector<std::thread> threads;
+   for (unsigned r=0;r<2;r++)
+      threads.push_back(std::thread([&,r] {
+         std::mt19937_64 rng(r);
+         while (!done) {
+            uint64_t value=keys[rng()%half];
+            uint8_t key[8];loadKey(value,key);
+            Node* leaf=lookupOLC(tree,key,8,8);
+            wrong+=!(isLeaf(leaf)&&getLeafValue(leaf)==value);
+         }
+      }));
+   std::vector<std::thread> writers;
+   for (unsigned w=0;w<2;w++)
+      writers.push_back(std::thread([&,w] {
+         for (uint64_t i=half+w;i<keys.size();i+=2) {
+            uint8_t key[8];loadKey(keys[i],key);
+            insertOLC(tree,key,keys[i],8);
+         }
+      }));
+   for (std::thread& t : writers)
+      t.join();
+   done=true;
+   for (std::thread& t : threads)
+      t.join();
+   CHECK(wrong==0);
+   checkTree(tree.root,std::set<uint64_t>(keys.begin(),keys.end()));
+   destroy(tree.root);
+}
+
+struct TestGroup {
+   const char* name;
+   void (*run)();
+};
+
+static const TestGroup groups[]={
+   {"insert",testInsert},
+   {"bulk",testBulk},
+   {"iterator",testIterator},
+   {"arena",testArena},
+   {"merge",testMerge},
+   {"snapshot",testSnapshot},
+   {"image",testImage},
+   {"records",testRecords},
+   {"stream",testStream},
+   {"olc",testOLC},
+};
+
+int main(int argc,char** argv) {
+   unsigned ran=0;
+   for (const TestGroup& group : groups) {
+      bool selected=argc<2;
+      for (int i=1;i<argc;i++)
+         selected|=strcmp(argv[i],group.name)==0;
+      if (!selected)
+         continue;
+      unsigned before=failures;
+      group.run();
+      printf("%s: %s\n",group.name,failures==before?"ok":"FAILED");
+      ran++;
+   }
+   if (ran==0) {
+      printf("usage: %s [group...]\ngroups:",argv[0]);
+      for (const TestGroup& group : groups)
+         printf(" %s",group.name);
+      printf("\n");
+      return 1;
+   }
+   return failures?1:0;
+}